@@ -0,0 +1,47 @@
+;
+; load-benchmark.scm - Compare full-table load speeds.
+;
+; This loads the same table several times, each time with different
+; bridge options given in the URI, and prints the load rate for each.
+; Each run uses a fresh AtomSpace, so that every run pays the full
+; cost of creating Atoms.
+;
+; Pick a large table with mostly numeric columns to see the effect of
+; the `binary` and `copy` options; for FlyBase, `feature_relationship`
+; has about a million rows of integer id's.
+;
+; To run this, say `guile -l load-benchmark.scm` after adjusting
+; the database and table names below.
+
+(use-modules (opencog) (opencog persist))
+(use-modules (opencog persist-bridge))
+
+(define db-uri "postgres:///flybase")
+(define table-name "feature_relationship")
+
+; List of option strings to compare. Each is appended to `db-uri`.
+(define option-sets (list
+	"?binary=off&copy=off"
+	"?binary=on&copy=off"
+	"?binary=on&copy=on"
+))
+
+; Load the table once, using the given options.
+(define (time-load OPTS)
+	(define base-as (cog-atomspace))
+	(cog-set-atomspace! (cog-new-atomspace))
+	(let* ((store (BridgeStorageNode (string-append db-uri OPTS)))
+			(table (Predicate table-name))
+			(dummy (cog-open store))
+			(dum2 (cog-bridge-load-tables store))
+			(start (get-internal-real-time))
+			(dum3 (fetch-incoming-set table))
+			(secs (exact->inexact (/ (- (get-internal-real-time) start)
+				internal-time-units-per-second)))
+			(nrows (length (cog-incoming-by-type table 'EdgeLink))))
+		(format #t "~A: loaded ~A rows in ~,2F secs; ~,0F rows/sec\n"
+			OPTS nrows secs (/ nrows secs))
+		(cog-close store))
+	(cog-set-atomspace! base-as))
+
+(for-each time-load option-sets)
@@ -69,6 +69,12 @@
 		(cog-outgoing-set varli)
 		(cog-outgoing-set naked)))
 
+;; ---------------------------------------------------
+; Estimated number of rows in the table PRED, or -1 if unknown.
+(define (table-rows PRED)
+	(define sizes (cog-value PRED (Predicate "*-bridge-table-size-*")))
+	(if (nil? sizes) -1 (inexact->exact (cog-value-ref sizes 0))))
+
 ;; ---------------------------------------------------
 ; Get the TypedVariable for string COL-STR, else #f
 (define (get-vardecl COL-STR)
@@ -109,9 +115,10 @@
 
 		((equal? "?" tbl-str)
 			(begin
-				(for-each (lambda (PRED)
-					(format #t "   ~A\n" (cog-name PRED)))
-					(cog-get-atoms 'Predicate))
+				(for-each (lambda (SIG)
+					(format #t "   ~A \t~A rows\n"
+						(cog-name (gar SIG)) (table-rows (gar SIG))))
+					table-descs)
 				(table-select)))
 
 		(else
@@ -122,7 +129,8 @@
 					(table-select))
 				(let ((start (current-time)))
 
-	(format #t "Loading '~A'. This might take a few minutes; please be patient!\n" tbl-str)
+	(format #t "Loading '~A', about ~A rows. This might take a few minutes; please be patient!\n"
+		tbl-str (table-rows tablename))
 	(fetch-incoming-set tablename)
 	(format #t "Loaded '~A' in ~A seconds\n" tbl-str (- (current-time) start))
 	(print-table tablename)
@@ -67,6 +67,12 @@ void BridgePersistSCM::init(void)
 		&BridgePersistSCM::do_load_tables, this, "persist-bridge");
 	define_scheme_primitive("cog-bridge-load-rows",
 		&BridgePersistSCM::do_load_rows, this, "persist-bridge");
+	define_scheme_primitive("cog-bridge-load-query",
+		&BridgePersistSCM::do_load_query, this, "persist-bridge");
+	define_scheme_primitive("cog-bridge-project",
+		&BridgePersistSCM::do_project, this, "persist-bridge");
+	define_scheme_primitive("cog-bridge-forget",
+		&BridgePersistSCM::do_forget, this, "persist-bridge");
 }
 
 BridgePersistSCM::~BridgePersistSCM()
@@ -95,6 +101,32 @@ HandleSeq BridgePersistSCM::do_load_rows(const Handle& ston,
 	return stnp->load_rows(table, column, entry);
 }
 
+void BridgePersistSCM::do_load_query(const Handle& ston,
+                                      const Handle& query)
+{
+	GET_STNP("cog-bridge-load-query");
+	stnp->load_query(query);
+}
+
+Handle BridgePersistSCM::do_project(const Handle& ston,
+                                    const Handle& table,
+                                    const Handle& columns)
+{
+	GET_STNP("cog-bridge-project");
+	return stnp->project(table, columns);
+}
+
+void BridgePersistSCM::do_forget(const Handle& ston, const Handle& item)
+{
+	GET_STNP("cog-bridge-forget");
+
+	// Passing the StorageNode itself means "forget everything".
+	if (item == ston)
+		stnp->forget(Handle::UNDEFINED);
+	else
+		stnp->forget(item);
+}
+
 void opencog_persist_bridge_init(void)
 {
 	static BridgePersistSCM patty(nullptr);
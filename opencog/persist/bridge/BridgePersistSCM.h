@@ -48,6 +48,9 @@ public:
 
 	HandleSeq do_load_tables(const Handle&);
 	HandleSeq do_load_rows(const Handle&, const Handle&, const Handle&, const Handle&);
+	void do_load_query(const Handle&, const Handle&);
+	Handle do_project(const Handle&, const Handle&, const Handle&);
+	void do_forget(const Handle&, const Handle&);
 
 }; // class
 
@@ -27,6 +27,13 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <algorithm>
+#include <cctype>
+#include <exception>
+#include <thread>
+
+#include <opencog/util/Logger.h>
+#include <opencog/util/platform.h>
 #include <opencog/atoms/atom_types/types.h>
 #include <opencog/atoms/base/Node.h>
 #include <opencog/atomspace/AtomSpace.h>
@@ -39,8 +46,44 @@
 
 using namespace opencog;
 
-// Hard-code to 3 threads for now
+// Default number of connections kept open. More are opened on
+// demand, up to the number of CPU's, and closed again after they
+// have been idle for a while.
 #define POOL_SIZE 3
+#define POOL_IDLE_SECS 60
+
+// Default number of rows to pull from a cursor, per round-trip.
+#define FETCH_ROWS 10000
+
+// Tables are scanned in parallel, if they have at least twice this
+// many disk pages. The default 8KB pages makes this 128 MBytes.
+#define PART_PAGES 16384
+
+// Max number of distinct values, per column, that the row decoder
+// will remember.
+#define INTERN_SIZE 1024
+
+// Number of decoded rows to hold, before adding them to the AtomSpace.
+#define BATCH_ROWS 1000
+
+// Estimated cost (in Postgres planner units) above which a lookup on
+// an unindexed column is handled by the scan policy, and the number
+// of rows that the `limit` policy allows.
+#define SCAN_MAX_COST 10000.0
+#define SCAN_MAX_ROWS 1000
+
+// Max number of rows kept in the AtomSpace. Zero means no limit.
+#define MAX_ROWS 0
+
+// Number of rows to queue up for a table, before writing them.
+#define WRITE_ROWS 10000
+
+// Max number of milliseconds that a write waits for a group commit.
+#define COMMIT_MSECS 1000
+
+// Number of seconds during which a completed load is not repeated.
+// Off by default; fetches then always go to the database, as before.
+#define MEMO_TTL_SECS 0
 
 /* ================================================================ */
 // Constructors
@@ -57,29 +100,288 @@ BridgeStorage::BridgeStorage(std::string uri) :
 		throw IOException(TRACE_INFO,
 			"Unknown URI '%s'\nValid URI's start with 'postgres://'\n", yuri);
 
-	// _name = _uri;
-	_initial_conn_pool_size = 0;
+	_fetch_rows = FETCH_ROWS;
+	_binary = true;
+	_copy = true;
+	_part_pages = PART_PAGES;
+	_intern_size = INTERN_SIZE;
+	_batch_rows = BATCH_ROWS;
+	_join_keys = false;
+	_scan_policy = SCAN_WARN;
+	_explain = false;
+	_scan_cost = SCAN_MAX_COST;
+	_scan_limit = SCAN_MAX_ROWS;
+	_memo_ttl = MEMO_TTL_SECS;
+	_max_rows = MAX_ROWS;
+	_write_rows = WRITE_ROWS;
+	_commit_ms = COMMIT_MSECS;
+	_sync_commit = true;
+	_committer_stop = false;
+	_committer_kick = false;
+	_catalog = std::make_shared<const Catalog>();
+	_pool_min = POOL_SIZE;
+	_pool_max = std::max((size_t) POOL_SIZE,
+		(size_t) std::thread::hardware_concurrency());
+	_pool_idle = POOL_IDLE_SECS;
+	parse_options();
+
 	_is_open = false;
+	_started = false;
 }
 
 BridgeStorage::~BridgeStorage()
 {
-	close();
+	// Destructors must not throw; if the queued rows can't be written
+	// now, they are lost.
+	try { close(); }
+	catch (const std::exception& ex)
+	{
+		logger().warn("Failed to close %s: %s", _name.c_str(), ex.what());
+	}
+
+	// A running thread can't be destroyed.
+	stop_committer();
 }
 
 /* ================================================================ */
-// Connections and opening
+// URI options
+
+static bool to_bool(const std::string& val)
+{
+	if (0 == val.compare("true") or 0 == val.compare("on") or
+	    0 == val.compare("yes") or 0 == val.compare("1"))
+		return true;
+	if (0 == val.compare("false") or 0 == val.compare("off") or
+	    0 == val.compare("no") or 0 == val.compare("0"))
+		return false;
+	throw std::invalid_argument(val);
+}
+
+/// Convert a count. Unlike std::stoul, which wraps "-1" around to a
+/// huge number, this refuses signs and trailing junk. If `zero_ok`
+/// is not set, zero is refused, too.
+static size_t to_count(const std::string& val, bool zero_ok = true)
+{
+	if (val.empty() or not isdigit((unsigned char) val[0]))
+		throw std::invalid_argument(val);
+
+	size_t end = 0;
+	size_t n = std::stoul(val, &end);
+	if (end != val.size() or (0 == n and not zero_ok))
+		throw std::invalid_argument(val);
+	return n;
+}
 
-void BridgeStorage::enlarge_conn_pool(int delta, const char* uri)
+/// Set one of the bridge options. Returns false if the key is not
+/// one of ours, in which case it is presumably a Postgres option.
+bool BridgeStorage::set_option(const std::string& key,
+                               const std::string& val)
 {
-	if (0 >= delta) return;
-	for (int i=0; i<delta; i++)
+	// Number of rows to pull per round-trip, when loading entire
+	// tables. Zero means "pull the whole table in one gulp".
+	if (0 == key.compare("fetch_rows"))
 	{
-		LLConnection* db_conn = new LLPGConnection(uri);
-		conn_pool.push(db_conn);
+		_fetch_rows = to_count(val);
+		return true;
+	}
+
+	// Ask for numeric columns in binary format, so that they can be
+	// decoded directly, instead of going through strings.
+	if (0 == key.compare("binary"))
+	{
+		_binary = to_bool(val);
+		return true;
+	}
+
+	// Load whole tables with COPY, instead of SELECT. Requires binary.
+	if (0 == key.compare("copy"))
+	{
+		_copy = to_bool(val);
+		return true;
 	}
 
-	_initial_conn_pool_size += delta;
+	// Minimum number of disk pages per parallel scan of a large
+	// table. Zero disables parallel scans.
+	if (0 == key.compare("part_pages"))
+	{
+		_part_pages = to_count(val);
+		return true;
+	}
+
+	// Size of the per-column intern cache. Zero disables it.
+	if (0 == key.compare("intern_size"))
+	{
+		_intern_size = to_count(val);
+		return true;
+	}
+
+	// Number of rows to decode before adding them to the AtomSpace.
+	if (0 == key.compare("batch_rows"))
+	{
+		_batch_rows = to_count(val, false);
+		return true;
+	}
+
+	// Max number of rows to keep in the AtomSpace. The least recently
+	// used ones are removed, when there are more. Zero means no limit.
+	if (0 == key.compare("max_rows"))
+	{
+		_max_rows = to_count(val);
+		return true;
+	}
+
+	// Number of rows to queue for a table, before writing them with
+	// a single COPY.
+	if (0 == key.compare("write_rows"))
+	{
+		_write_rows = to_count(val, false);
+		return true;
+	}
+
+	// Group commit: pending writes are sent together, in one
+	// transaction, at least this often. Zero means only at barrier().
+	if (0 == key.compare("commit_ms"))
+	{
+		_commit_ms = to_count(val);
+		return true;
+	}
+
+	// Let the server acknowledge commits before they are on disk.
+	// A crash of the server may lose the last few commits; but they
+	// are not half-done. Good for bulk loads.
+	if (0 == key.compare("sync_commit"))
+	{
+		_sync_commit = to_bool(val);
+		return true;
+	}
+
+	// Join rows only along declared FOREIGN KEY relations, instead
+	// of by matching column names.
+	if (0 == key.compare("join_keys"))
+	{
+		_join_keys = to_bool(val);
+		return true;
+	}
+
+	// Lookups on columns without an index are full-table scans. These
+	// can be allowed, warned about, refused, or limited to a number of
+	// rows. If `explain` is on, only those that Postgres estimates to
+	// cost more than `scan_cost` are affected.
+	if (0 == key.compare("scan_policy"))
+	{
+		if (0 == val.compare("allow")) _scan_policy = SCAN_ALLOW;
+		else if (0 == val.compare("warn")) _scan_policy = SCAN_WARN;
+		else if (0 == val.compare("refuse")) _scan_policy = SCAN_REFUSE;
+		else if (0 == val.compare("limit")) _scan_policy = SCAN_LIMIT;
+		else throw std::invalid_argument(val);
+		return true;
+	}
+	if (0 == key.compare("explain"))
+	{
+		_explain = to_bool(val);
+		return true;
+	}
+	if (0 == key.compare("scan_cost"))
+	{
+		size_t end = 0;
+		_scan_cost = std::stod(val, &end);
+		if (end != val.size() or _scan_cost < 0.0)
+			throw std::invalid_argument(val);
+		return true;
+	}
+	if (0 == key.compare("scan_limit"))
+	{
+		_scan_limit = to_count(val, false);
+		return true;
+	}
+
+	// Seconds to remember that a table or row was loaded, and not
+	// ask for it again. Zero disables this.
+	if (0 == key.compare("memo_ttl"))
+	{
+		_memo_ttl = to_count(val);
+		return true;
+	}
+
+	// Connection pool size bounds, and the number of seconds that an
+	// extra connection can sit idle before it is closed.
+	if (0 == key.compare("pool_min"))
+	{
+		_pool_min = to_count(val, false);
+		return true;
+	}
+	if (0 == key.compare("pool_max"))
+	{
+		_pool_max = to_count(val, false);
+		return true;
+	}
+	if (0 == key.compare("pool_idle"))
+	{
+		_pool_idle = to_count(val);
+		return true;
+	}
+	return false;
+}
+
+/// Bridge options can be appended to the URI, in the same way that
+/// Postgres connection parameters are. For example:
+///    postgres:///flybase?user=foo&fetch_rows=5000
+/// Postgres refuses to connect if it sees parameters it does not
+/// know about, so the bridge options are stripped out of the `_uri`
+/// that is handed to the driver.
+void BridgeStorage::parse_options(void)
+{
+	size_t qm = _name.find('?');
+	_uri = _name.substr(0, qm);
+	if (std::string::npos == qm) return;
+
+	char sep = '?';
+	size_t pos = qm + 1;
+	while (pos <= _name.size())
+	{
+		size_t amp = _name.find('&', pos);
+		if (std::string::npos == amp) amp = _name.size();
+
+		std::string kv = _name.substr(pos, amp - pos);
+		pos = amp + 1;
+		if (0 == kv.size()) continue;
+
+		size_t eq = kv.find('=');
+		std::string key = kv.substr(0, eq);
+		std::string val;
+		if (std::string::npos != eq) val = kv.substr(eq + 1);
+
+		bool ours = false;
+		try { ours = set_option(key, val); }
+		catch (const std::exception&)
+		{
+			throw IOException(TRACE_INFO,
+				"Bad value for option '%s' in URI '%s'\n",
+				key.c_str(), _name.c_str());
+		}
+		if (ours) continue;
+
+		_uri += sep;
+		_uri += kv;
+		sep = '&';
+	}
+}
+
+/* ================================================================ */
+// Connections and opening
+
+void BridgeStorage::open_conn_pool(void)
+{
+	// Postgres settings go in the `options` connection parameter, so
+	// that they are set again if a connection is reset.
+	std::string uri = _uri;
+	if (not _sync_commit)
+		uri += std::string(std::string::npos == uri.find('?') ? "?" : "&") +
+			"options=-c%20synchronous_commit%3Doff";
+	conn_pool.configure(
+		[uri](void) -> LLConnection* { return new LLPGConnection(uri.c_str()); },
+		_pool_min, _pool_max, _pool_idle);
+	conn_pool.open();
 }
 
 // Public function
@@ -88,9 +390,10 @@ void BridgeStorage::open(void)
 	// User might call us twice. If so, ignore the second call.
 	if (_is_open) return;
 
-	if (0 == _initial_conn_pool_size)
-		enlarge_conn_pool(POOL_SIZE, _name.c_str());
+	if (conn_pool.is_closed())
+		open_conn_pool();
 
+	_started = true;
 	_is_open = true;
 	if (not connected())
 		throw IOException(TRACE_INFO,
@@ -100,29 +403,62 @@ void BridgeStorage::open(void)
 	_num_queries = 0;
 	_num_tables = 0;
 	_num_rows = 0;
+	_num_intern_hits = 0;
+	_num_intern_misses = 0;
+	_num_memo_hits = 0;
+	_num_unindexed = 0;
+	_num_refused = 0;
+	_num_evicted = 0;
+	_num_rows_stored = 0;
+	_num_rows_skipped = 0;
+	_num_copies = 0;
+	_num_updates = 0;
+	_num_updates_absorbed = 0;
+	_num_update_stmts = 0;
+	_num_deletes = 0;
+	_num_delete_stmts = 0;
+	_num_commits = 0;
+	_num_commit_rows = 0;
+	forget(Handle::UNDEFINED);
 
 	// We don't really need to do this...
 	get_server_version();
 printf("Connected to Postgres server version %d\n", _server_version);
+
+	start_committer();
 }
 
 void BridgeStorage::close(void)
 {
-	if (not _is_open) return;
+	// Not `_is_open`: that is cleared if the server went away, and
+	// then there is still a committer to stop, and a pool to close.
+	if (not _started) return;
+	_started = false;
 
-	close_conn_pool();
+	// Refuse new writes, while the queued ones are drained.
 	_is_open = false;
+	stop_committer();
+	close_conn_pool();
 }
 
 bool BridgeStorage::connected(void)
 {
 	if (0 == _is_open) return false;
-	if (0 == _initial_conn_pool_size) return false;
+	if (conn_pool.is_empty()) return false;
 
-	// This will leak a resource, if db_conn->connected() ever throws.
-	LLConnection* db_conn = conn_pool.value_pop();
-	bool have_connection = db_conn->connected();
-	conn_pool.push(db_conn);
+	// Getting a connection from the pool checks its health, and
+	// replaces it, if it's broken. That fails only if the server
+	// cannot be reached at all.
+	bool have_connection = true;
+	try
+	{
+		LLConnection* db_conn = conn_pool.value_pop();
+		conn_pool.push(db_conn);
+	}
+	catch (const std::exception&)
+	{
+		have_connection = false;
+	}
 
 	_is_open = have_connection;
 	return have_connection;
@@ -130,14 +466,63 @@ bool BridgeStorage::connected(void)
 
 void BridgeStorage::close_conn_pool(void)
 {
-   // flushStoreQueue();
+	// Write everything that is queued, while there are still
+	// connections to write it with. The pool is closed even if
+	// that fails.
+	std::exception_ptr eptr;
+	try { barrier(); }
+	catch (...) { eptr = std::current_exception(); }
+
+	conn_pool.close();
+	if (eptr) std::rethrow_exception(eptr);
+}
+
+/* ================================================================== */
+
+/// Run `job(0)` through `job(njobs-1)` in parallel, using as many
+/// threads as there are connections in the pool. Each job is expected
+/// to grab its own connection; with one thread per connection, no
+/// thread will ever wait on the pool. This returns only after all of
+/// the jobs have finished. If any of them threw, the first exception
+/// is rethrown here.
+void BridgeStorage::run_parallel(size_t njobs,
+                                 const std::function<void(size_t)>& job)
+{
+	size_t nthreads = std::min(njobs, conn_pool.max_size());
+	if (nthreads <= 1)
+	{
+		for (size_t i=0; i<njobs; i++) job(i);
+		return;
+	}
+
+	std::atomic<size_t> next(0);
+	std::exception_ptr eptr;
+	std::mutex emtx;
 
-   while (not conn_pool.is_empty())
-   {
-      LLConnection* db_conn = conn_pool.value_pop();
-      delete db_conn;
-   }
-   _initial_conn_pool_size = 0;
+	auto worker = [&](void)
+	{
+		set_thread_name("bridge:fanout");
+		while (true)
+		{
+			size_t i = next++;
+			if (njobs <= i) return;
+			try { job(i); }
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lck(emtx);
+				if (not eptr) eptr = std::current_exception();
+				next = njobs;  // Stop handing out more work.
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t t=0; t<nthreads; t++)
+		threads.emplace_back(worker);
+	for (std::thread& th : threads)
+		th.join();
+
+	if (eptr) std::rethrow_exception(eptr);
 }
 
 /* ================================================================== */
@@ -146,8 +531,19 @@ void BridgeStorage::close_conn_pool(void)
 /// barrier really are performed before before all the writes after
 /// the barrier.
 ///
+/// All of the queued writes are sent in one group commit. If any write
+/// failed since the last barrier, the error is thrown here.
 void BridgeStorage::barrier(AtomSpace* as)
 {
+	flushStoreQueue();
+
+	std::exception_ptr eptr;
+	{
+		std::lock_guard<std::mutex> lck(_write_mtx);
+		eptr = _write_error;
+		_write_error = nullptr;
+	}
+	if (eptr) std::rethrow_exception(eptr);
 }
 
 /* ================================================================ */
@@ -166,11 +562,79 @@ std::string BridgeStorage::monitor(void)
 	}
 
 	rs += "Connected to: " + _name + "\n";
-	rs += "Posgres server version: " + _server_version;
+	rs += "Posgres server version: " + std::to_string(_server_version);
 	rs += "\n";
 	rs += "Number of queries issued: " + std::to_string(_num_queries) + "\n";
 	rs += "Number of loaded tables: " + std::to_string(_num_tables) + "\n";
+	CatalogPtr cat(catalog());
+	rs += "Number of foreign keys: " + std::to_string(cat->fkeys.size()) + "\n";
 	rs += "Number of rows loaded: " + std::to_string(_num_rows) + "\n";
+
+	size_t hits = _num_intern_hits;
+	size_t lookups = hits + _num_intern_misses;
+	rs += "Intern cache hits: " + std::to_string(hits) +
+		" of " + std::to_string(lookups);
+	if (0 < lookups)
+		rs += " (" + std::to_string((100 * hits) / lookups) + "%)";
+	rs += "\n";
+
+	size_t nmemo = 0;
+	{
+		std::lock_guard<std::mutex> lck(_memo_mtx);
+		nmemo = _memo.size();
+	}
+	rs += "Loads remembered: " + std::to_string(nmemo) +
+		"; repeats skipped: " + std::to_string(_num_memo_hits) + "\n";
+	size_t nresident = 0;
+	{
+		std::lock_guard<std::mutex> lck(_lru_mtx);
+		nresident = _lru.size();
+	}
+	if (0 < _max_rows)
+		rs += "Rows resident: " + std::to_string(nresident) +
+			" of " + std::to_string(_max_rows) +
+			"; evicted: " + std::to_string(_num_evicted) + "\n";
+
+	rs += "Rows stored: " + std::to_string(_num_rows_stored) +
+		" in " + std::to_string(_num_copies) + " COPY batches; " +
+		"duplicates skipped: " + std::to_string(_num_rows_skipped) +
+		"; " + std::to_string(queued_rows()) + " rows queued\n";
+	rs += "Column updates: " + std::to_string(_num_updates) +
+		"; absorbed: " + std::to_string(_num_updates_absorbed) +
+		"; sent in " + std::to_string(_num_update_stmts) +
+		" UPDATE statements\n";
+	rs += "Rows deleted: " + std::to_string(_num_deletes) +
+		" in " + std::to_string(_num_delete_stmts) +
+		" DELETE statements\n";
+	size_t ncommits = _num_commits;
+	rs += "Commits: " + std::to_string(ncommits);
+	if (0 < ncommits)
+		rs += "; average rows per commit: " +
+			std::to_string(_num_commit_rows / ncommits);
+	rs += "\n";
+
+	rs += "Lookups on unindexed columns: " +
+		std::to_string(_num_unindexed) + "\n";
+	rs += "Lookups refused by the scan policy: " +
+		std::to_string(_num_refused) + "\n";
+
+	// The largest tables, by total size on disk. Projections have the
+	// same sizes as their full tables; don't list those twice.
+	std::vector<const TableDesc*> bysize;
+	for (const auto& pr : cat->tables)
+		if (0 == cat->projections.count(pr.first))
+			bysize.push_back(pr.second.get());
+	size_t nbig = std::min(bysize.size(), (size_t) 10);
+	std::partial_sort(bysize.begin(), bysize.begin() + nbig, bysize.end(),
+		[](const TableDesc* a, const TableDesc* b)
+		{ return a->total_bytes > b->total_bytes; });
+	if (0 < nbig)
+		rs += "Largest tables (estimated rows, MBytes):\n";
+	for (size_t i=0; i<nbig; i++)
+		rs += "   " + bysize[i]->name + ": " +
+			std::to_string((long long) bysize[i]->reltuples) + ", " +
+			std::to_string(bysize[i]->total_bytes / (1024*1024)) + "\n";
+	rs += conn_pool.stats();
 	return rs;
 }
 
@@ -31,13 +31,27 @@
 #define _ATOMSPACE_FOREIGN_STORAGE_H
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <tuple>
 
+#include <opencog/util/Logger.h>
 #include <opencog/atomspace/AtomSpace.h>
 #include <opencog/persist/api/StorageNode.h>
 
 #include "llapi.h"
+#include "ll-pool.h"
+
+class BridgeStorageUTest;
 
 namespace opencog
 {
@@ -47,36 +61,294 @@ namespace opencog
 
 class BridgeStorage : public StorageNode
 {
+	friend class ::BridgeStorageUTest;
+
 	private:
 		std::string _uri;
 
+		// Options that can be given in the URI.
+		bool set_option(const std::string&, const std::string&);
+		void parse_options(void);
+		size_t _fetch_rows;
+		bool _binary;
+		bool _copy;
+		size_t _part_pages;
+		size_t _intern_size;
+		size_t _batch_rows;
+		bool _join_keys;
+
+		// What to do about lookups on columns without an index.
+		enum ScanPolicy { SCAN_ALLOW, SCAN_WARN, SCAN_REFUSE, SCAN_LIMIT };
+		ScanPolicy _scan_policy;
+		bool _explain;
+		double _scan_cost;
+		size_t _scan_limit;
+		unsigned int _memo_ttl;
+		size_t _max_rows;
+		size_t _write_rows;
+		unsigned int _commit_ms;
+		bool _sync_commit;
+
 		// Pool of shared connections
-		concurrent_stack<LLConnection*> conn_pool;
-		int _initial_conn_pool_size;
-		void enlarge_conn_pool(int, const char*);
+		LLConnPool conn_pool;
+		size_t _pool_min;
+		size_t _pool_max;
+		unsigned int _pool_idle;
+		void open_conn_pool(void);
 		void close_conn_pool(void);
 
 		// Utility for handling responses (on stack).
 		class Response;
 
+		// `_is_open` is cleared when the server goes away; `_started`
+		// stays set until close(), which must still stop the committer.
 		bool _is_open;
+		bool _started;
 		int _server_version;
 		void get_server_version(void);
 
 		// Stats for a given session.
-		size_t _num_queries;
-		size_t _num_tables;
-		size_t _num_rows;
+		std::atomic<size_t> _num_queries;
+		std::atomic<size_t> _num_tables;
+		std::atomic<size_t> _num_rows;
+		std::atomic<size_t> _num_intern_hits;
+		std::atomic<size_t> _num_intern_misses;
+		std::atomic<size_t> _num_memo_hits;
+		std::atomic<size_t> _num_unindexed;
+		std::atomic<size_t> _num_refused;
+		std::atomic<size_t> _num_evicted;
+		std::atomic<size_t> _num_rows_stored;
+		std::atomic<size_t> _num_rows_skipped;
+		std::atomic<size_t> _num_copies;
+		std::atomic<size_t> _num_updates;
+		std::atomic<size_t> _num_updates_absorbed;
+		std::atomic<size_t> _num_update_stmts;
+		std::atomic<size_t> _num_deletes;
+		std::atomic<size_t> _num_delete_stmts;
+		std::atomic<size_t> _num_commits;
+		std::atomic<size_t> _num_commit_rows;
+
+		// Memo of the loads that have already been done. The key is
+		// (table, column, entry) for a lookup, and (table, null, null)
+		// for a whole table. The value is when the load was started.
+		typedef std::chrono::steady_clock Clock;
+		typedef std::tuple<Handle, Handle, Handle> MemoKey;
+		std::map<MemoKey, Clock::time_point> _memo;
+		Clock::time_point _last_evict;
+		std::mutex _memo_mtx;
+		bool memo_check(const MemoKey&);
+		void memo_note(const MemoKey&, Clock::time_point);
+
+		// Rows (EdgeLinks) loaded into the AtomSpace, least recently
+		// touched first. Once there are more than `_max_rows` of them,
+		// the oldest are extracted from the AtomSpace.
+		std::list<Handle> _lru;
+		std::unordered_map<Handle, std::list<Handle>::iterator> _lru_pos;
+		std::mutex _lru_mtx;
+		void touch_rows(const HandleSeq&);
+		void evict_rows(const HandleSeq&);
+
+		// Rows waiting to be written, per table. storeAtom() puts them
+		// here; the group commit sends them. If that fails, the error
+		// is held until the next barrier.
+		std::map<Handle, std::set<Handle>> _write_batches;
+		std::exception_ptr _write_error;
+		std::mutex _write_mtx;
+
+		// SQL statements, each with the number of rows that it writes.
+		typedef std::vector<std::pair<std::string, size_t>> Stmts;
+
+		// Column updates waiting to be written. For each row, named by
+		// its SQL table and primary key, the newest value of each
+		// changed column, by column name, as an SQL literal. A newer
+		// value for the same cell replaces the older one, so that only
+		// the last is written, even if it was set on another Atom for
+		// the same row, such as a projection of it.
+		typedef std::pair<std::string, std::map<std::string, std::string>>
+			RowKey;
+		typedef std::map<RowKey, std::map<std::string, std::string>>
+			UpdateMap;
+		UpdateMap _updates;
+		std::mutex _update_mtx;
+		void queue_update(const Handle&, const Handle&);
+		Stmts update_stmts(const UpdateMap&);
+
+		// Rows waiting to be deleted, named by SQL table and primary
+		// key, as for the updates.
+		std::set<RowKey> _deletes;
+		std::mutex _delete_mtx;
+		Stmts delete_stmts(const std::set<RowKey>&);
+
+		// Group commit. flushStoreQueue() sends all pending writes in
+		// one transaction, holding `_commit_mtx`; a failed statement is
+		// rolled back to its savepoint, and the rest go in. Its error
+		// is put in `_write_error` before `_commit_mtx` is let go, so
+		// that a barrier waiting on the commit always sees it. The
+		// committer thread calls it every `_commit_ms` milliseconds, or
+		// sooner, when kicked. It runs for as long as the StorageNode
+		// is open.
+		std::mutex _commit_mtx;
+		void flushStoreQueue(void);
+		void send_writes(void);
+		size_t queued_rows(void);
+		std::thread _committer;
+		std::mutex _committer_mtx;
+		std::condition_variable _committer_cv;
+		bool _committer_stop;
+		bool _committer_kick;
+		void committer(void);
+		void start_committer(void);
+		void stop_committer(void);
+		void kick_committer(void);
+
+		// Fan out work over the connection pool.
+		void run_parallel(size_t, const std::function<void(size_t)>&);
+
+		// In-memory catalog of the loaded tables. It is built by
+		// load_tables(), and all query planning uses it, instead of
+		// walking the incoming sets of the Signatures.
+		struct ColumnDesc
+		{
+			std::string name;    // SQL column name
+			std::string pgtype;  // Postgres type name
+			Handle var;          // VariableNode
+			Handle coldesc;      // TypedVariable
+			Type kind;           // Type of Atom for the values
+			size_t ordinal;      // Position in the row
+			bool indexed;        // Leading column of some index
+			bool primary;        // Part of the PRIMARY KEY
+		};
+		struct TableDesc
+		{
+			std::string name;    // SQL table name
+			Handle pred;         // PredicateNode
+			Handle varlist;      // VariableList of the coldescs
+			Handle sig;          // Signature
+			std::vector<ColumnDesc> columns;
+
+			// Size estimates from pg_class, as of load_tables().
+			// `reltuples` is -1 if the table was never analyzed.
+			double reltuples;    // Number of rows
+			size_t relpages;     // Number of disk pages
+			size_t total_bytes;  // Including indexes and TOAST
+
+			// Plan for loading rows, compiled once by load_tables():
+			// the `SELECT col1, col2, ... FROM table ` text, and the
+			// type of Atom to make for each column, by ordinal.
+			std::string select;
+			std::vector<Type> kinds;
+
+			// Plan for writing rows: create a staging table, COPY
+			// into it, and then merge it into the table, skipping the
+			// rows whose key is already there. The merge returns the
+			// number of rows written.
+			std::string stage;
+			std::string copy;
+			std::string merge;
+
+			// Ordinals of the PRIMARY KEY columns, for updating rows.
+			// Empty if there is no key, or if some key column is not
+			// among the columns; `npkey` is the size of the whole key.
+			size_t npkey;
+			std::vector<size_t> pkey;
+		};
+		typedef std::shared_ptr<const TableDesc> TableDescPtr;
+
+		// A column is identified by (table PredicateNode, column
+		// TypedVariable).
+		typedef std::pair<Handle, Handle> ColKey;
+
+		struct Catalog
+		{
+			std::map<Handle, TableDescPtr> tables;
+
+			// Tables holding a column. The key is either the column's
+			// VariableNode or its TypedVariable; the value is the list
+			// of table PredicateNodes.
+			std::map<Handle, HandleSeq> column_tables;
+
+			// Projections: tables holding only some columns. The key
+			// is the projection's PredicateNode; the value is the full
+			// table, and the columns, as given to project().
+			std::map<Handle, std::pair<Handle, Handle>> projections;
+
+			// Declared FOREIGN KEY relations. `fkeys` maps a
+			// referencing column to the column it references;
+			// `fkrefs` is the reverse.
+			std::map<ColKey, ColKey> fkeys;
+			std::multimap<ColKey, ColKey> fkrefs;
+		};
+		typedef std::shared_ptr<const Catalog> CatalogPtr;
+
+		// The catalog is never changed in place. Changes are made to a
+		// copy, which then replaces it; `_catalog_mtx` guards only the
+		// pointer. Readers take a snapshot with catalog(), and keep it
+		// (or the TableDescPtr from get_table()) for as long as they
+		// use it. `_catalog_edit_mtx` keeps two changes from racing.
+		CatalogPtr _catalog;
+		std::mutex _catalog_mtx;
+		std::mutex _catalog_edit_mtx;
+		CatalogPtr catalog(void);
+		void publish(const CatalogPtr&);
+		TableDescPtr get_table(const Handle&);
+		static TableDescPtr get_table(const Catalog&, const Handle&);
+		void compile_table(TableDesc&);
+		Handle project_into(Catalog&, const Handle&, const Handle&);
+		void load_foreign_keys(Catalog&);
+		std::string copy_data(const TableDesc&, const std::set<Handle>&);
+		static bool fits_column(const ColumnDesc&, const Handle&);
+		static bool fits_value(const ColumnDesc&, const ValuePtr&);
+		static bool fits_number(const std::string&, double);
+		static std::string to_param(const ColumnDesc&, const Handle&);
+		static std::string sql_literal(const std::string&, const ValuePtr&);
+		RowKey row_key(const TableDesc&, const Handle&);
+		void find_rows(const Catalog&, const Handle&, HandleSet&, HandleSeq&);
+		void queue_deletes(const Catalog&, const HandleSeq&);
+		static std::vector<std::string>
+			fk_order(const Catalog&, const std::set<std::string>&);
+
+		// Key for the FloatValue holding the table size estimates.
+		Handle _size_key;
 
 		// Loading of table definitions
-		Handle load_one_table(const std::string&);
-		Handle get_row_desc(const Handle&);
 		std::string make_select(const Handle&);
-		void load_selected_rows(const Handle&, const std::string&);
+		void make_rows(Response&, const Handle&);
+		void load_selected_rows(const Handle&, const std::string&, bool,
+		                        const std::string& snapshot="");
 		void load_table_data(const Handle&);
+		size_t count_pages(const std::string&);
+
+		// Held during a split load of a large table, which holds one
+		// connection while it waits for more; see load_table_data().
+		std::mutex _part_mtx;
 		void load_column(const Handle&);
-		void select_where(const Handle&, const Handle&, const Handle&);
-		void load_join(const Handle&, const Handle&);
+
+		// A single `SELECT ... WHERE column = entry` lookup.
+		struct Lookup
+		{
+			Handle entry;      // Concept or Number
+			Handle coldesc;    // TypedVariable
+			Handle tablename;  // PredicateNode
+		};
+
+		// What the scan policy made of a lookup. A limited lookup may
+		// have missed some rows, so it must not be memoized. A refused
+		// lookup, or one for an entry that can't be in the column, is
+		// not run at all.
+		enum LookupKind { LOOKUP_FULL, LOOKUP_LIMITED, LOOKUP_REFUSED };
+		LookupKind make_lookup(const Lookup&, LLQuery&, bool);
+
+		// Estimated costs of lookups on unindexed columns, as found
+		// with EXPLAIN; -1 if not explained. Each column is looked at
+		// only the first time that it is used.
+		std::map<ColKey, double> _scan_costs;
+		std::mutex _scan_mtx;
+		LookupKind guard_scan(const TableDesc&, const ColumnDesc&,
+		                      LLQuery&, bool);
+		double explain_cost(const LLQuery&);
+		void select_where(const std::vector<Lookup>&, bool direct=false);
+		void plan_join(const Handle&, const Handle&, const Handle&,
+		               std::vector<Lookup>&);
 		void load_joined_rows(const Handle&);
 
 	public:
@@ -121,6 +393,9 @@ class BridgeStorage : public StorageNode
 		// Extra functions
 		HandleSeq load_tables(void);
 		HandleSeq load_rows(const Handle&, const Handle&, const Handle&);
+		void load_query(const Handle&);
+		Handle project(const Handle&, const Handle&);
+		void forget(const Handle&);
 };
 
 class BridgeStorageNode : public BridgeStorage
@@ -136,8 +411,17 @@ class BridgeStorageNode : public BridgeStorage
 		void setAtomSpace(AtomSpace* as)
 		{
 			// This is called with a null pointer when this
-			// Atom is extracted from the AtomSpace.
-			if (nullptr == as) close();
+			// Atom is extracted from the AtomSpace. There is no
+			// caller to throw to, then; see ~BridgeStorage().
+			if (nullptr == as)
+			{
+				try { close(); }
+				catch (const std::exception& ex)
+				{
+					logger().warn("Failed to close %s: %s",
+						_name.c_str(), ex.what());
+				}
+			}
 			Atom::setAtomSpace(as);
 		}
 		static Handle factory(const Handle&);
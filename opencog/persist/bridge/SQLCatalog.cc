@@ -0,0 +1,387 @@
+/*
+ * FILE:
+ * opencog/persist/bridge/SQLCatalog.cc
+ *
+ * FUNCTION:
+ * Loading of SQL table descriptions, and the in-memory catalog.
+ *
+ * HISTORY:
+ * Copyright (c) 2022 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <opencog/util/Logger.h>
+#include <opencog/atoms/base/Node.h>
+#include <opencog/atoms/value/FloatValue.h>
+
+#include "BridgeStorage.h"
+
+#include "SQLResponse.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+
+/// Load the descriptions of all tables in the `public` schema, and
+/// create a Signature for each. This is done with a single query on
+/// the system catalogs, instead of one query per table; the slow
+/// `information_schema` views are avoided, too.
+///
+/// Only ordinary and partitioned tables are loaded (relkind 'r' and
+/// 'p'), same as `pg_tables`; views and such are skipped.
+/// If the same table is in two schemas, only the `public` one is used.
+/// This will get bad results for user-defined types...
+///
+/// A column is marked as indexed if it is the first column of some
+/// index; only then can Postgres use the index to look it up. The
+/// PRIMARY KEY columns are marked, too; rows are updated by key.
+///
+/// The size estimates of each table are attached to its PredicateNode,
+/// as a FloatValue holding (rows, disk pages, total bytes), under the
+/// key `(Predicate "*-bridge-table-size-*")`. These are the planner's
+/// estimates, as of the last VACUUM or ANALYZE; rows are -1 if the
+/// table was never analyzed.
+///
+/// The catalog of tables is replaced by the one loaded here.
+HandleSeq BridgeStorage::load_tables(void)
+{
+	if (not _is_open)
+		throw RuntimeException(TRACE_INFO,
+			"Error: can't load tables; StorageNode is not open!");
+
+	// The total size has to look at every file of the table, its
+	// indexes and its TOAST; so it is found once per table, in the
+	// WITH clause, and not once per column. The function is volatile,
+	// so Postgres won't fold the WITH clause into the main query.
+	_num_queries++;
+	Response rp(conn_pool);
+	rp.exec(
+		"WITH c AS (SELECT c.oid, c.relname, c.reltuples, c.relpages, "
+		"pg_catalog.pg_total_relation_size(c.oid) AS total_bytes "
+		"FROM pg_catalog.pg_class c "
+		"JOIN pg_catalog.pg_namespace n ON n.oid = c.relnamespace "
+		"WHERE n.nspname = 'public' AND c.relkind IN ('r', 'p')) "
+		"SELECT c.relname, a.attname, t.typname, "
+		"EXISTS (SELECT 1 FROM pg_catalog.pg_index i "
+		"WHERE i.indrelid = c.oid AND i.indkey[0] = a.attnum), "
+		"c.reltuples, c.relpages, c.total_bytes, "
+		"EXISTS (SELECT 1 FROM pg_catalog.pg_index i "
+		"WHERE i.indrelid = c.oid AND i.indisprimary "
+		"AND a.attnum = ANY (i.indkey)), "
+		"(SELECT i.indnkeyatts FROM pg_catalog.pg_index i "
+		"WHERE i.indrelid = c.oid AND i.indisprimary) "
+		"FROM c "
+		"JOIN pg_catalog.pg_attribute a ON a.attrelid = c.oid "
+		"JOIN pg_catalog.pg_type t ON t.oid = a.atttypid "
+		"WHERE a.attnum > 0 AND NOT a.attisdropped "
+		"ORDER BY c.relname, a.attnum;");
+
+	std::vector<TableDesc> tdescs;
+	rp.as = _atom_space;
+	rp.tdescs = &tdescs;
+	rp.rs->foreach_row(&Response::tabledesc_cb, &rp);
+
+	_size_key = _atom_space->add_node(PREDICATE_NODE,
+		"*-bridge-table-size-*");
+
+	HandleSeq tabs;
+	std::shared_ptr<Catalog> cat(std::make_shared<Catalog>());
+	for (TableDesc& td : tdescs)
+	{
+		// Nothing can be done with a table without any columns that
+		// we know how to handle.
+		if (0 == td.columns.size())
+		{
+			logger().info("Skipping table %s; no usable columns",
+				td.name.c_str());
+			continue;
+		}
+
+		td.pred = _atom_space->add_node(PREDICATE_NODE, std::string(td.name));
+		compile_table(td);
+		tabs.push_back(td.sig);
+
+		for (const ColumnDesc& cd : td.columns)
+		{
+			cat->column_tables[cd.var].push_back(td.pred);
+			cat->column_tables[cd.coldesc].push_back(td.pred);
+		}
+
+		_atom_space->set_value(td.pred, _size_key,
+			createFloatValue(std::vector<double>({td.reltuples,
+				(double) td.relpages, (double) td.total_bytes})));
+
+		Handle pred(td.pred);
+		cat->tables[pred] = std::make_shared<const TableDesc>(std::move(td));
+	}
+
+	std::lock_guard<std::mutex> elck(_catalog_edit_mtx);
+
+	// Put back the projections, if the columns are still there.
+	CatalogPtr old(catalog());
+	for (const auto& pr : old->projections)
+	{
+		try { project_into(*cat, pr.second.first, pr.second.second); }
+		catch (const RuntimeException&)
+		{
+			logger().info("Dropping projection %s",
+				pr.first->get_name().c_str());
+		}
+	}
+
+	load_foreign_keys(*cat);
+	publish(cat);
+
+	// Indexes might have changed; look at the scans again.
+	{
+		std::lock_guard<std::mutex> lck(_scan_mtx);
+		_scan_costs.clear();
+	}
+
+	_num_tables = tabs.size();
+	_num_rows += _num_tables;
+	// printf("Found %lu tables\n", _num_tables);
+
+	return tabs;
+}
+
+/// Load the FOREIGN KEY constraints in the `public` schema, for the
+/// tables in the catalog `cat`.
+///
+/// Only single-column keys are loaded; composite keys cannot be
+/// followed with a single `column = entry` lookup. Keys on columns
+/// of unsupported types are skipped, too.
+void BridgeStorage::load_foreign_keys(Catalog& cat)
+{
+	_num_queries++;
+	Response rp(conn_pool);
+	rp.exec(
+		"SELECT fc.relname, fa.attname, pc.relname, pa.attname "
+		"FROM pg_catalog.pg_constraint k "
+		"JOIN pg_catalog.pg_class fc ON fc.oid = k.conrelid "
+		"JOIN pg_catalog.pg_namespace n ON n.oid = fc.relnamespace "
+		"JOIN pg_catalog.pg_attribute fa "
+		"ON fa.attrelid = k.conrelid AND fa.attnum = k.conkey[1] "
+		"JOIN pg_catalog.pg_class pc ON pc.oid = k.confrelid "
+		"JOIN pg_catalog.pg_attribute pa "
+		"ON pa.attrelid = k.confrelid AND pa.attnum = k.confkey[1] "
+		"WHERE k.contype = 'f' AND n.nspname = 'public' "
+		"AND cardinality(k.conkey) = 1;");
+
+	// Four strings per row.
+	std::vector<std::string> fks;
+	rp.strvec = &fks;
+	rp.rs->foreach_row(&Response::strvec_cb, &rp);
+
+	// The constraints name the columns; look up the Atoms for them.
+	std::map<std::pair<std::string, std::string>, ColKey> colkeys;
+	for (const auto& pr : cat.tables)
+	{
+		// Projections share the name of their full table.
+		if (cat.projections.count(pr.first)) continue;
+		for (const ColumnDesc& cd : pr.second->columns)
+			colkeys[{pr.second->name, cd.name}] = {pr.first, cd.coldesc};
+	}
+
+	cat.fkeys.clear();
+	cat.fkrefs.clear();
+	for (size_t i=0; i+3 < fks.size(); i += 4)
+	{
+		auto from = colkeys.find({fks[i], fks[i+1]});
+		auto to = colkeys.find({fks[i+2], fks[i+3]});
+		if (colkeys.end() == from or colkeys.end() == to) continue;
+
+		cat.fkeys[from->second] = to->second;
+		cat.fkrefs.insert({to->second, from->second});
+	}
+}
+
+/// Fill in the Signature and the compiled plan for a table, given its
+/// PredicateNode and columns. The Signature has the general form:
+///
+///    Signature
+///       Predicate "gene.allele"
+///       VariableList
+///          TypedVariable
+///              Variable "symbol"
+///              Type 'GeneNode
+///
+void BridgeStorage::compile_table(TableDesc& td)
+{
+	HandleSeq tcols;
+	std::string colnames;
+	td.kinds.clear();
+	for (const ColumnDesc& cd : td.columns)
+	{
+		tcols.push_back(cd.coldesc);
+		colnames += cd.name + ", ";
+		td.kinds.push_back(cd.kind);
+	}
+
+	// Trim the trailing comma
+	colnames.pop_back();
+	colnames.pop_back();
+	td.select = "SELECT " + colnames + " FROM " + td.name + " ";
+
+	// The staging table is dropped after the merge, so that the next
+	// table in the same transaction can use the name; see
+	// flushStoreQueue(). ON COMMIT DROP is for when it never gets that
+	// far.
+	td.stage = "CREATE TEMP TABLE bridge_stage ON COMMIT DROP AS " +
+		td.select + "WITH NO DATA;";
+	td.copy = "COPY bridge_stage (" + colnames + ") FROM STDIN;";
+	td.merge = "WITH ins AS (INSERT INTO " + td.name + " (" + colnames +
+		") SELECT " + colnames + " FROM bridge_stage "
+		"ON CONFLICT DO NOTHING RETURNING 1) SELECT count(*) FROM ins;";
+
+	// Rows can be updated only if the whole key is among the columns.
+	td.pkey.clear();
+	for (const ColumnDesc& cd : td.columns)
+		if (cd.primary) td.pkey.push_back(cd.ordinal);
+	if (td.pkey.size() != td.npkey) td.pkey.clear();
+
+	td.varlist = _atom_space->add_link(VARIABLE_LIST, std::move(tcols));
+	td.sig = _atom_space->add_link(SIGNATURE_LINK, td.pred, td.varlist);
+}
+
+/* ================================================================ */
+
+/// Create a projection of a table: a table holding only some of the
+/// columns. `columns` is a VariableList of the column Variables (or
+/// TypedVariables) to keep, or a single one. Returns the PredicateNode
+/// for the projection, which is named after the table and the columns,
+/// for example `(Predicate "feature(feature_id, name)")`.
+///
+/// The projection gets its own Signature, and its rows are Edges on
+/// its own Predicate, so that they cannot be mistaken for full rows.
+/// It can be loaded and queried just like any other table; only the
+/// projected columns are fetched. Projections are not used when
+/// joining, since they don't hold all of the columns.
+Handle BridgeStorage::project(const Handle& tablename, const Handle& columns)
+{
+	std::lock_guard<std::mutex> elck(_catalog_edit_mtx);
+	std::shared_ptr<Catalog> cat(std::make_shared<Catalog>(*catalog()));
+	Handle pred(project_into(*cat, tablename, columns));
+	publish(cat);
+	return pred;
+}
+
+/// Add a projection to the catalog `cat`, which is not yet published.
+Handle BridgeStorage::project_into(Catalog& cat, const Handle& tablename,
+                                   const Handle& columns)
+{
+	// A projection of a projection is a projection of the full table.
+	Handle full(tablename);
+	auto pj = cat.projections.find(tablename);
+	if (cat.projections.end() != pj) full = pj->second.first;
+
+	TableDescPtr basep(get_table(cat, full));
+	const TableDesc& base(*basep);
+
+	HandleSeq cols;
+	if (columns->is_type(VARIABLE_LIST))
+		cols = columns->getOutgoingSet();
+	else
+		cols.push_back(columns);
+
+	TableDesc td;
+	td.name = base.name;
+	td.reltuples = base.reltuples;
+	td.relpages = base.relpages;
+	td.total_bytes = base.total_bytes;
+	td.npkey = base.npkey;
+
+	std::string pname = td.name + "(";
+	for (const Handle& col : cols)
+	{
+		const ColumnDesc* found = nullptr;
+		for (const ColumnDesc& cd : base.columns)
+			if (cd.var == col or cd.coldesc == col) { found = &cd; break; }
+
+		if (nullptr == found)
+			throw RuntimeException(TRACE_INFO,
+				"Table %s has no column %s\n", td.name.c_str(),
+				col->to_short_string().c_str());
+
+		td.columns.push_back(*found);
+		td.columns.back().ordinal = td.columns.size() - 1;
+		pname += found->name + ", ";
+	}
+
+	if (0 == td.columns.size())
+		throw RuntimeException(TRACE_INFO,
+			"Empty projection of table %s\n", td.name.c_str());
+
+	pname.pop_back();
+	pname.back() = ')';
+
+	td.pred = _atom_space->add_node(PREDICATE_NODE, std::move(pname));
+	compile_table(td);
+
+	Handle pred(td.pred);
+	cat.tables[pred] = std::make_shared<const TableDesc>(std::move(td));
+	cat.projections[pred] = {full, columns};
+	return pred;
+}
+
+/* ================================================================ */
+
+/// Return a snapshot of the catalog. It stays valid, and unchanged,
+/// for as long as it is held, even if the catalog is replaced.
+BridgeStorage::CatalogPtr BridgeStorage::catalog(void)
+{
+	std::lock_guard<std::mutex> lck(_catalog_mtx);
+	return _catalog;
+}
+
+/// Replace the catalog.
+void BridgeStorage::publish(const CatalogPtr& cat)
+{
+	std::lock_guard<std::mutex> lck(_catalog_mtx);
+	_catalog = cat;
+}
+
+/// Return the catalog entry for a table, from the current catalog.
+BridgeStorage::TableDescPtr
+BridgeStorage::get_table(const Handle& tablename)
+{
+	return get_table(*catalog(), tablename);
+}
+
+/// Return the catalog entry for a table. The `tablename` must be a
+/// PredicateNode, naming one of the tables found by load_tables().
+BridgeStorage::TableDescPtr
+BridgeStorage::get_table(const Catalog& cat, const Handle& tablename)
+{
+	if (not tablename->is_type(PREDICATE_NODE))
+		throw RuntimeException(TRACE_INFO,
+			"Error: Expecting the table name to be a Predicate; got %s\n",
+			tablename->to_short_string().c_str());
+
+	auto it = cat.tables.find(tablename);
+	if (cat.tables.end() == it)
+		throw RuntimeException(TRACE_INFO,
+			"Unknown table %s; were the tables loaded?\n",
+			tablename->to_short_string().c_str());
+
+	return it->second;
+}
+
+/* ============================= END OF FILE ================= */
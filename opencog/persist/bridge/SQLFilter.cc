@@ -0,0 +1,245 @@
+/*
+ * FILE:
+ * opencog/persist/bridge/SQLFilter.cc
+ *
+ * FUNCTION:
+ * Push the constraints in Atomese queries down to SQL WHERE clauses.
+ *
+ * HISTORY:
+ * Copyright (c) 2022 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <opencog/atoms/base/Node.h>
+
+#include "BridgeStorage.h"
+
+#include "SQLResponse.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+// Filter pushdown.
+//
+// A query such as
+//
+//    (Meet
+//       (VariableList (Variable "$gt") (Variable "$name"))
+//       (And
+//          (Present
+//             (Edge (Predicate "genotype")
+//                (List (Variable "$gt") (Variable "$name") (Concept "foo"))))
+//          (GreaterThan (Variable "$gt") (Number 42))))
+//
+// only needs those rows of `genotype` whose third column is "foo", and
+// whose first column is more than 42. Rather than loading the whole
+// table, and letting the pattern matcher throw most of it away, these
+// constraints are turned into
+//
+//    SELECT ... FROM genotype WHERE description = $1 AND genotype_id > $2
+//
+// and only the matching rows are loaded. After that, the query can be
+// run as usual.
+//
+// Every Edge clause in the query body is loaded, wherever it is, since
+// the pattern matcher needs its rows even to check that it is absent.
+// Only constraints that hold for every match are pushed down, though.
+// The constant cells of an Edge always hold, for that Edge. Equal,
+// GreaterThan and LessThan between a variable and a constant hold only
+// at the top level of the query body, or inside And and Present; so
+// only Edges found there are filtered on them. An Edge under Not,
+// Absent, Or, Choice, Always and so on is filtered on its own constant
+// cells alone. Joins between tables are left to the pattern matcher,
+// too; each table is filtered on its own.
+// Constants that Postgres could not convert to the column's type, such
+// as a ConceptNode compared to an integer column, are not pushed down
+// either; the pattern matcher sorts those out.
+
+namespace {
+
+/// A comparison between a variable and a constant.
+struct Compare
+{
+	Handle var;
+	const char* op;
+	Handle value;
+};
+
+/// Return true if this is a constant that can be compared to a column.
+bool is_constant(const Handle& h)
+{
+	return h->is_type(CONCEPT_NODE) or h->is_type(NUMBER_NODE);
+}
+
+/// An Edge clause, and whether the comparisons apply to it.
+struct Clause
+{
+	Handle edge;
+	bool compared;
+};
+
+/// Walk the query body, collecting all of the Edge clauses, and the
+/// comparisons that must hold for every match. `top` is true while
+/// the walk is at the top level, or under And and Present only.
+void collect(const Handle& h, std::vector<Clause>& edges,
+             std::vector<Compare>& cmps, bool top = true)
+{
+	if (not h->is_link()) return;
+
+	Type t = h->get_type();
+	if (EDGE_LINK == t)
+	{
+		edges.push_back({h, top});
+		return;
+	}
+
+	if (AND_LINK == t or PRESENT_LINK == t)
+	{
+		for (const Handle& ho : h->getOutgoingSet())
+			collect(ho, edges, cmps, top);
+		return;
+	}
+
+	// Anything else might not hold for every match; look only for
+	// the Edges under it.
+	for (const Handle& ho : h->getOutgoingSet())
+		collect(ho, edges, cmps, false);
+
+	if (not top or 2 != h->get_arity()) return;
+	const Handle& a(h->getOutgoingAtom(0));
+	const Handle& b(h->getOutgoingAtom(1));
+	bool avar = a->is_type(VARIABLE_NODE) and is_constant(b);
+	bool bvar = b->is_type(VARIABLE_NODE) and is_constant(a);
+	if (not avar and not bvar) return;
+
+	// Put the variable on the left, flipping the comparison if needed.
+	const Handle& var(avar ? a : b);
+	const Handle& val(avar ? b : a);
+	if (EQUAL_LINK == t or IDENTICAL_LINK == t)
+		cmps.push_back({var, "=", val});
+	else if (GREATER_THAN_LINK == t)
+		cmps.push_back({var, avar ? ">" : "<", val});
+	else if (LESS_THAN_LINK == t)
+		cmps.push_back({var, avar ? "<" : ">", val});
+}
+
+} // anonymous namespace
+
+/// Load the rows needed to run the query `qry`, which must be a
+/// QueryLink or a MeetLink. One SELECT is issued for each clause of the
+/// form `(Edge (Predicate "table") (List ...))`, naming a loaded table,
+/// anywhere in the query body; its WHERE clause holds the constraints
+/// on the columns of that clause that hold for every match. A clause
+/// without any such constraints loads the whole table.
+/// The selects are run in parallel.
+void BridgeStorage::load_query(const Handle& qry)
+{
+	if (not qry->is_type(QUERY_LINK) and not qry->is_type(MEET_LINK))
+		throw RuntimeException(TRACE_INFO,
+			"Error: Expecting a QueryLink or MeetLink; got %s\n",
+			qry->to_short_string().c_str());
+
+	// The body is after the variable declarations, if there are any.
+	const HandleSeq& oset(qry->getOutgoingSet());
+	Handle body(oset.at(0));
+	if (1 < oset.size() and
+	    (body->is_type(VARIABLE_LIST) or body->is_type(VARIABLE_NODE) or
+	     body->is_type(TYPED_VARIABLE_LINK)))
+		body = oset[1];
+
+	std::vector<Clause> edges;
+	std::vector<Compare> cmps;
+	collect(body, edges, cmps);
+
+	struct Select
+	{
+		Handle tablename;
+		std::string query;
+		std::vector<std::string> params;
+	};
+	std::vector<Select> selects;
+	HandleSeq whole;
+
+	CatalogPtr cat(catalog());
+	for (const Clause& clause : edges)
+	{
+		const Handle& edge(clause.edge);
+		if (2 != edge->get_arity()) continue;
+		const Handle& tablename(edge->getOutgoingAtom(0));
+		const Handle& row(edge->getOutgoingAtom(1));
+		if (cat->tables.end() == cat->tables.find(tablename)) continue;
+
+		const TableDesc& td(*get_table(*cat, tablename));
+		if (not row->is_type(LIST_LINK) or
+		    td.columns.size() != row->get_arity())
+			continue;
+
+		Select sel;
+		sel.tablename = tablename;
+		std::string where;
+		auto add = [&](const ColumnDesc& cd, const char* op, const Handle& val)
+		{
+			if (not fits_column(cd, val)) return;
+			sel.params.push_back(to_param(cd, val));
+			where += (where.empty() ? "WHERE " : " AND ") + cd.name +
+				" " + op + " $" + std::to_string(sel.params.size());
+		};
+
+		const HandleSeq& cells(row->getOutgoingSet());
+		for (size_t i=0; i<cells.size(); i++)
+		{
+			const ColumnDesc& cd(td.columns[i]);
+			if (is_constant(cells[i]))
+				add(cd, "=", cells[i]);
+			else if (clause.compared and cells[i]->is_type(VARIABLE_NODE))
+			{
+				for (const Compare& cmp : cmps)
+					if (cmp.var == cells[i])
+						add(cd, cmp.op, cmp.value);
+			}
+		}
+
+		if (where.empty())
+			whole.push_back(tablename);
+		else
+		{
+			sel.query = td.select + where + ";";
+			selects.emplace_back(std::move(sel));
+		}
+	}
+
+	for (const Handle& tablename : whole)
+		load_table_data(tablename);
+
+	run_parallel(selects.size(), [&](size_t i)
+	{
+		const Select& sel(selects[i]);
+		std::vector<const char*> params;
+		for (const std::string& p : sel.params)
+			params.push_back(p.c_str());
+
+		_num_queries++;
+		Response rp(conn_pool);
+		rp.exec_params(sel.query, params.size(), params.data(), _binary);
+		make_rows(rp, sel.tablename);
+	});
+}
+
+/* ============================= END OF FILE ================= */
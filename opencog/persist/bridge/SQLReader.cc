@@ -28,6 +28,8 @@
  */
 
 #include <filesystem>
+#include <set>
+#include <tuple>
 #include <sys/resource.h>
 
 #include <opencog/util/Logger.h>
@@ -52,213 +54,533 @@ void BridgeStorage::get_server_version(void)
 }
 
 /* ================================================================ */
-
-Handle BridgeStorage::load_one_table(const std::string& tablename)
+// Memo of completed loads.
+//
+// Browsing back and forth between tables asks for the same rows over
+// and over. The rows are already in the AtomSpace; there is no point
+// in fetching them again, unless they might have changed. So remember
+// which loads were done, and skip repeats for `_memo_ttl` seconds.
+
+/// Return true if the load was done recently enough that it does not
+/// need to be repeated. A lookup is also covered if the whole table
+/// it is in was loaded.
+bool BridgeStorage::memo_check(const MemoKey& key)
 {
-	// Simple query. Placeholder, see notes for what we really need.
-	// udt_name is better than data_type
-	// If same table in two schemas, then add `AND table_schema = 'foo'`
-	// This will get bad results for user-defined types...
-	std::string buff =
-		"SELECT column_name AS c, udt_name AS t "
-		"FROM information_schema.columns "
-		"WHERE table_name = '" + tablename + "';";
-
-	Response rp(conn_pool);
-	rp.exec(buff);
+	if (0 == _memo_ttl) return false;
 
-	HandleSeq tcols;
-	rp.as = _atom_space;
-	rp.tentries = &tcols;
-	rp.rs->foreach_row(&Response::tabledesc_cb, &rp);
-
-	if (0 == tcols.size())
-		throw RuntimeException(TRACE_INFO,
-			"Error: can't find a table description for %s", tablename.c_str());
+	Clock::time_point stale = Clock::now() - std::chrono::seconds(_memo_ttl);
+	MemoKey whole(std::get<0>(key), Handle::UNDEFINED, Handle::UNDEFINED);
 
-	// Create a signature of the general form:
-	//
-	//    Signature
-	//       Edge
-	//          Predicate "gene.allele"
-	//          List
-	//             TypedVariable
-	//                 Variable "symbol"
-	//                 Type 'GeneNode
-
-	Handle tabc = _atom_space->add_link(VARIABLE_LIST, std::move(tcols));
-	Handle tabn = _atom_space->add_node(PREDICATE_NODE, std::string(tablename));
-	Handle tabs = _atom_space->add_link(SIGNATURE_LINK, tabn, tabc);
-	// printf("============= Loaded table ==>%s<==\n", tablename.c_str());
-
-	return tabs;
+	std::lock_guard<std::mutex> lck(_memo_mtx);
+	for (const MemoKey& k : {whole, key})
+	{
+		auto it = _memo.find(k);
+		if (_memo.end() == it) continue;
+		if (it->second < stale)
+		{
+			_memo.erase(it);
+			continue;
+		}
+		_num_memo_hits++;
+		return true;
+	}
+	return false;
 }
 
-HandleSeq BridgeStorage::load_tables(void)
+/// Record that a load was done. `start` is when the query was issued;
+/// anything that changed in the database after that might be missed,
+/// so that is when the memo entry starts aging.
+///
+/// If rows were evicted while the load was running, some of the rows
+/// it loaded might be gone already; in that case, it is not recorded.
+void BridgeStorage::memo_note(const MemoKey& key, Clock::time_point start)
 {
-	if (not _is_open)
-		throw RuntimeException(TRACE_INFO,
-			"Error: can't load tables; StorageNode is not open!");
+	if (0 == _memo_ttl) return;
 
-	_num_queries++;
-	Response rp(conn_pool);
-	// This fetches everything except the postgres tables.
-	// Unfortunately, it fetches view and other non-table things.
-	// rp.exec("SELECT tablename FROM pg_tables WHERE schemaname != 'pg_catalog';");
+	std::lock_guard<std::mutex> lck(_memo_mtx);
+	if (start <= _last_evict) return;
+	_memo[key] = start;
+}
 
-	// This seems like the correct hack-of-the-moment.
-	rp.exec("SELECT tablename FROM pg_tables WHERE schemaname = 'public';");
+/// Forget that loads were done, so that the next request goes to the
+/// database again. If `h` is a PredicateNode, all loads from that
+/// table are forgotten; if it is a VariableNode, all loads by that
+/// column; else all lookups of that entry. If `h` is null, everything
+/// is forgotten.
+void BridgeStorage::forget(const Handle& h)
+{
+	std::lock_guard<std::mutex> lck(_memo_mtx);
+	if (nullptr == h)
+	{
+		_memo.clear();
+		return;
+	}
 
-	std::vector<std::string> tabnames;
-	rp.strvec = &tabnames;
-	rp.rs->foreach_row(&Response::strvec_cb, &rp);
+	for (auto it = _memo.begin(); it != _memo.end(); )
+	{
+		const Handle& coldesc(std::get<1>(it->first));
+		if (std::get<0>(it->first) == h or std::get<2>(it->first) == h or
+		    (coldesc and coldesc->getOutgoingAtom(0) == h))
+			it = _memo.erase(it);
+		else
+			it++;
+	}
+}
 
-	_num_tables = tabnames.size();
-	_num_rows += _num_tables;
-	// printf("Found %lu tables\n", _num_tables);
+/* ================================================================ */
+// Row residency.
+//
+// Every row that is loaded stays in the AtomSpace, until it is removed.
+// For data sets that don't fit in RAM, that's a problem. If `_max_rows`
+// is set, the rows are kept in least-recently-used order, and the
+// oldest ones are extracted once there are too many. Their data is
+// still in Postgres; it can always be loaded again.
+
+/// Mark these rows as recently used, adding them to the LRU list if
+/// they are not in it already. Then evict rows, if over budget.
+void BridgeStorage::touch_rows(const HandleSeq& rows)
+{
+	if (0 == _max_rows) return;
 
-	HandleSeq tabs;
-	for (const std::string& tn : tabnames)
-		tabs.emplace_back(load_one_table(tn));
+	HandleSeq evict;
+	{
+		std::lock_guard<std::mutex> lck(_lru_mtx);
+		for (const Handle& row : rows)
+		{
+			auto it = _lru_pos.find(row);
+			if (_lru_pos.end() != it)
+				_lru.splice(_lru.end(), _lru, it->second);
+			else
+				_lru_pos[row] = _lru.insert(_lru.end(), row);
+		}
 
-	return tabs;
+		while (_max_rows < _lru.size())
+		{
+			evict.push_back(_lru.front());
+			_lru_pos.erase(_lru.front());
+			_lru.pop_front();
+		}
+	}
+	evict_rows(evict);
 }
 
-/* ================================================================ */
-
-/// Obtain and return the VariableList from a Signature for a table.
-///
-/// We are expecting this structure to be available:
-///
-///   Signature
-///       Predicate "some table"  <-- this is given tablename
-///       VariableList            <-- this is what we return.
-///           TypedVariable
-///               Variable "column name"
-///               Type 'AtomType
-///           ...
-///
-/// There should be one and only one such structure in RAM.
+/// Extract rows from the AtomSpace. The ListLink under each EdgeLink
+/// is extracted too, if nothing else is using it. The column values
+/// are left alone; they are likely to be shared with other rows.
 ///
-Handle BridgeStorage::get_row_desc(const Handle& tablename)
+/// Memo entries for the tables of these rows are dropped, since loads
+/// from those tables are no longer complete in the AtomSpace.
+void BridgeStorage::evict_rows(const HandleSeq& rows)
 {
-	if (not tablename->is_type(PREDICATE_NODE))
-		throw RuntimeException(TRACE_INFO,
-			"Error: Expecting the table name to be a Predicate; got %s\n",
-			tablename->to_short_string().c_str());
+	if (0 == rows.size()) return;
 
-	HandleSeq sigs = tablename->getIncomingSetByType(SIGNATURE_LINK);
-	if (1 != sigs.size())
-		throw RuntimeException(TRACE_INFO,
-			"Cannot find signature for %s\n",
-			tablename->to_short_string().c_str());
+	std::set<Handle> tables;
+	for (const Handle& row : rows)
+	{
+		tables.insert(row->getOutgoingAtom(0));
+		Handle arow(row->getOutgoingAtom(1));
+		_atom_space->extract_atom(row);
+		if (0 == arow->getIncomingSetSize())
+			_atom_space->extract_atom(arow);
+	}
+	_num_evicted += rows.size();
 
-	return sigs[0]->getOutgoingAtom(1);
+	{
+		std::lock_guard<std::mutex> lck(_memo_mtx);
+		_last_evict = Clock::now();
+	}
+	for (const Handle& tab : tables)
+		forget(tab);
 }
 
-/// Create a SELECT statement for the given table.
-/// If will have the general form
-///    SELECT clo1, col2, ... FROM tablename
-/// with the column names take from the table signature.
+/* ================================================================ */
+
+/// Return the SELECT statement for the given table.
+/// It has the general form
+///    SELECT col1, col2, ... FROM tablename
+/// with the columns in the same order as in the table signature.
 std::string BridgeStorage::make_select(const Handle& tablename)
 {
-	std::string buff = "SELECT ";
-
-	// listl will be a VariableList; tvl will be a TypedVariableLink
-	// We build up a SQL string list of column names, based on the
-	// table signature.
-	Handle listl(get_row_desc(tablename));
-	for (const Handle& tvl : listl->getOutgoingSet())
-		buff += tvl->getOutgoingAtom(0)->get_name() + ", ";
-
-	// Trim the trailing comma
-	buff.pop_back();
-	buff.pop_back();
-	buff += " FROM " + tablename->get_name() + " ";
-
-	return buff;
+	return get_table(tablename)->select;
 }
 
 /* ================================================================ */
 
+/// Convert the rows in the response to Atoms. `tablename` must be a
+/// PredicateNode for a table in the catalog; the query must have
+/// selected the columns in the Signature order.
+void BridgeStorage::make_rows(Response& rp, const Handle& tablename)
+{
+	rp.nrows = 0;
+	rp.as = _atom_space;
+	rp.pred = tablename;
+	rp.store = this;
+
+	// The response points into the catalog entry; hold on to it until
+	// all of the rows are made.
+	TableDescPtr td(get_table(tablename));
+	rp.kinds = td->kinds.data();
+	rp.ncols = td->kinds.size();
+	rp.intern_reset(rp.ncols, _intern_size);
+	rp.intern_hits = 0;
+	rp.intern_misses = 0;
+	rp.batch_max = (0 < _batch_rows) ? _batch_rows : 1;
+	rp.batch.reserve(rp.batch_max);
+	rp.rs->foreach_row(&Response::tabledata_cb, &rp);
+	rp.commit_batch();
+	_num_rows += rp.nrows;
+	_num_intern_hits += rp.intern_hits;
+	_num_intern_misses += rp.intern_misses;
+}
+
 /// Load all rows in the table identified by the tablename.
 /// `tablename` must be a PredicateNode attached to a Signature
 /// describing the the table.
 /// `select` must be an SQL SELECT statement.
+/// If `bulk` is set, then the rows are streamed from the server,
+/// either with COPY or in batches from a cursor, and Atoms are created
+/// while the rows are still arriving. Use this for queries that might
+/// return a very large number of rows.
+/// If a `snapshot` is given, the query sees the data as of that
+/// snapshot; see Response::export_snapshot().
+///
+/// If the connection breaks while the rows are arriving, the query is
+/// started over, once, on a fresh connection. The rows that already
+/// arrived are in the AtomSpace; adding them again does nothing.
 void BridgeStorage::load_selected_rows(const Handle& tablename,
-                                        const std::string& select)
+                                        const std::string& select,
+                                        bool bulk,
+                                        const std::string& snapshot)
 {
-	_num_queries++;
-
-	Response rp(conn_pool);
-	rp.exec(select);
+	for (int tries = 0; ; tries++)
+	{
+		_num_queries++;
 
-	rp.nrows = 0;
-	rp.as = _atom_space;
-	rp.pred = tablename;
-	rp.cols = get_row_desc(tablename)->getOutgoingSet();
-	rp.rs->foreach_row(&Response::tabledata_cb, &rp);
-	_num_rows += rp.nrows;
+		Response rp(conn_pool);
+		try
+		{
+			if (not snapshot.empty())
+				rp.use_snapshot(snapshot);
+
+			if (bulk and _copy and _binary)
+				rp.copy_out(select);
+			else if (bulk and 0 < _fetch_rows)
+				rp.stream(select, _fetch_rows, _binary);
+			else
+				rp.exec_params(select, 0, nullptr, _binary);
+
+			make_rows(rp, tablename);
+			return;
+		}
+		catch (...)
+		{
+			if (0 < tries or rp.connected()) throw;
+		}
+		logger().warn("Lost the connection while loading %s; starting over",
+			tablename->get_name().c_str());
+	}
 }
 
 /// Load all rows in the table identified by the tablename.
 /// tablename must be a PredicateNode holding the name of an SQL table,
 /// and the signature of that table must already be known (loaded).
+///
+/// Large tables are split into ranges of disk blocks (by `ctid`), and
+/// the ranges are loaded in parallel, each on its own connection and
+/// thread. Postgres 14 and newer can scan a ctid range directly, so
+/// each range costs only its own share of the disk reads; older
+/// servers would need a full scan per range, so they don't get split.
+///
+/// All of the ranges see the same snapshot of the table. Otherwise, a
+/// row that is moved by an UPDATE, from a range not yet loaded into
+/// one that already was, would be missed. As in a parallel pg_dump,
+/// one connection exports its snapshot, and holds it while the ranges
+/// are loaded; so one connection fewer is left for the ranges. Only one
+/// table is split at a time: if several tables were loaded this way at
+/// once, in parallel, their snapshots could take every connection in
+/// the pool, leaving none for the ranges.
+///
+/// The number of pages is the estimate in the catalog, as of the last
+/// VACUUM or ANALYZE. A table that was never vacuumed or analyzed has
+/// no estimate; its actual size is asked for, instead.
 void BridgeStorage::load_table_data(const Handle& tablename)
 {
-	load_selected_rows(tablename, make_select(tablename) + ";");
+	MemoKey key(tablename, Handle::UNDEFINED, Handle::UNDEFINED);
+	if (memo_check(key)) return;
+
+	Clock::time_point start = Clock::now();
+	std::string select = make_select(tablename);
+
+	size_t nparts = 1;
+	size_t npages = 0;
+	if (0 < _part_pages and 140000 <= _server_version and
+	    1 < conn_pool.max_size())
+	{
+		TableDescPtr td(get_table(tablename));
+		npages = td->relpages;
+		if (0 == npages) npages = count_pages(td->name);
+		nparts = std::min(npages / _part_pages, conn_pool.max_size() - 1);
+	}
+
+	if (nparts <= 1)
+	{
+		load_selected_rows(tablename, select + ";", true);
+		memo_note(key, start);
+		return;
+	}
+
+	std::lock_guard<std::mutex> lck(_part_mtx);
+	Response leader(conn_pool);
+	std::string snap = leader.export_snapshot();
+
+	// The last range is left open-ended, in case the table grew
+	// since it was measured.
+	run_parallel(nparts, [&](size_t i)
+	{
+		size_t lo = (npages * i) / nparts;
+		size_t hi = (npages * (i+1)) / nparts;
+		std::string where = select +
+			"WHERE ctid >= '(" + std::to_string(lo) + ",0)'::tid";
+		if (i+1 < nparts)
+			where += " AND ctid < '(" + std::to_string(hi) + ",0)'::tid";
+		load_selected_rows(tablename, where + ";", true, snap);
+	});
+	memo_note(key, start);
+}
+
+/// Return the current size of a table, in disk blocks. Unlike the
+/// estimate in `pg_class`, this is always up to date.
+size_t BridgeStorage::count_pages(const std::string& table)
+{
+	_num_queries++;
+	const char* params[1] = { table.c_str() };
+	Response rp(conn_pool);
+	rp.exec_params("SELECT pg_catalog.pg_relation_size($1::regclass) / "
+		"pg_catalog.current_setting('block_size')::bigint;",
+		1, params, false);
+	rp.rs->foreach_row(&Response::intval_cb, &rp);
+	return rp.intval;
 }
 
 /* ================================================================ */
 
 /// Load all rows in all tables holding this column name.
+/// The tables are loaded in parallel, one per pooled connection.
 void BridgeStorage::load_column(const Handle& hv)
 {
-	// Starting at the variable, walk upwards, searching for
-	// Signatures holding this column.
-	HandleSeq typed_vars = hv->getIncomingSetByType(TYPED_VARIABLE_LINK);
-	for (const Handle& tvar : typed_vars)
-	{
-		HandleSeq varlists = tvar->getIncomingSetByType(VARIABLE_LIST);
-		for (const Handle& varli: varlists)
-		{
-			HandleSeq sigs = varli->getIncomingSetByType(SIGNATURE_LINK);
-			for (const Handle& sig: sigs)
-			{
-				load_table_data(sig->getOutgoingAtom(0));
-			}
-		}
-	}
+	CatalogPtr cat(catalog());
+	auto it = cat->column_tables.find(hv);
+	if (cat->column_tables.end() == it) return;
+	const HandleSeq& tables(it->second);
+
+	run_parallel(tables.size(),
+		[&](size_t i) { load_table_data(tables[i]); });
 }
 
 /* ================================================================ */
 
-/// Load rows from a single table, given just an entry in that row,
-/// a column descriptor for the entry, and the table name. Note that
-/// this can result in multiple rows being loaded, if that entry appears
-/// in multiple rows. of course, if 'entry' is a PRIMARY KEY then only
-/// one row is returned.
+/// Create the prepared-statement query for a lookup. Each connection
+/// prepares it the first time that it sees the query text; after that,
+/// only the entry changes. Since the statement goes by its text, a
+/// reloaded table, or a LIMIT added by the scan policy, gets a new one.
+/// Lookups on unindexed columns are subject to the scan policy; see
+/// guard_scan(). The `direct` flag is set for lookups asked for by the
+/// user, as opposed to those planned for a join.
 ///
-/// This creates an SQL 'SELECT ... WHERE ...' statement, and runs it.
-///
-void BridgeStorage::select_where(const Handle& entry,     // Concept or Number
-                                  const Handle& coldesc,   // TypedVariable
-                                  const Handle& tablename) // PredicateNode
+/// An entry that can't be in the column, such as a ConceptNode for an
+/// integer column, can't match any rows; that lookup is refused, too.
+BridgeStorage::LookupKind
+BridgeStorage::make_lookup(const Lookup& lu, LLQuery& q, bool direct)
 {
+	TableDescPtr tdp(get_table(lu.tablename));
+	const TableDesc& td(*tdp);
+	const ColumnDesc* cd = nullptr;
+	for (const ColumnDesc& c : td.columns)
+		if (c.coldesc == lu.coldesc) { cd = &c; break; }
+
+	if (nullptr == cd)
+		throw RuntimeException(TRACE_INFO,
+			"Table %s has no column %s\n", td.name.c_str(),
+			lu.coldesc->to_short_string().c_str());
+
+	if (not fits_column(*cd, lu.entry)) return LOOKUP_REFUSED;
+
 	// make_select() returns `SELECT col1,col2,.. FROM tablename`
-	std::string buff = make_select(tablename);
+	q.query = make_select(lu.tablename);
+	q.query += "WHERE " + cd->name + " = $1";
+	q.params.clear();
+	q.params.push_back(to_param(*cd, lu.entry));
+
+	LookupKind kind = LOOKUP_FULL;
+	if (not cd->indexed)
+		kind = guard_scan(td, *cd, q, direct);
+	q.query += ";";
+	return kind;
+}
 
-	// Get the column name
-	buff += "WHERE " + coldesc->getOutgoingAtom(0)->get_name() + " = ";
+/// Apply the scan policy to a lookup on an unindexed column. Such a
+/// lookup is a scan of the whole table; on a large table, this can
+/// run for minutes, while holding on to a connection.
+///
+/// If `_explain` is set, the lookup is first run through EXPLAIN, and
+/// it is let through if its estimated cost is below `_scan_cost`.
+/// Otherwise, it is refused, or allowed with a warning, or a LIMIT is
+/// appended to the query. All of this is done once per column; the
+/// same query (and thus the same decision) is used for all later
+/// lookups.
+///
+/// A refused `direct` lookup throws. Any other refused lookup is one
+/// step of a join; it is skipped, so that the rest of the join still
+/// gets done.
+BridgeStorage::LookupKind
+BridgeStorage::guard_scan(const TableDesc& td,
+                          const ColumnDesc& cd,
+                          LLQuery& q,
+                          bool direct)
+{
+	if (SCAN_ALLOW == _scan_policy) return LOOKUP_FULL;
+	_num_unindexed++;
+
+	ColKey key(td.pred, cd.coldesc);
+	double cost = -1.0;
+	bool first = false;
+	{
+		std::lock_guard<std::mutex> lck(_scan_mtx);
+		auto it = _scan_costs.find(key);
+		if (_scan_costs.end() != it) cost = it->second;
+		else first = true;
+	}
+	if (first)
+	{
+		if (_explain) cost = explain_cost(q);
+		std::lock_guard<std::mutex> lck(_scan_mtx);
+		_scan_costs[key] = cost;
+	}
+
+	if (_explain and 0.0 <= cost and cost < _scan_cost) return LOOKUP_FULL;
+
+	std::string what = td.name + "." + cd.name;
+	if (SCAN_REFUSE == _scan_policy)
+	{
+		if (direct)
+			throw RuntimeException(TRACE_INFO,
+				"Refusing lookup on unindexed column %s (estimated cost %g)\n"
+				"Create an index, or change the `scan_policy` option.\n",
+				what.c_str(), cost);
+
+		_num_refused++;
+		if (first)
+			logger().warn("Skipping joins on unindexed column %s "
+				"(estimated cost %g)", what.c_str(), cost);
+		return LOOKUP_REFUSED;
+	}
 
-	// Strings need quotes. Numbers do not.
-	Type ct = coldesc->getOutgoingAtom(1)->get_type();
-	if (NUMBER_NODE != ct) buff += "'";
-	buff += entry->get_name();
-	if (NUMBER_NODE != ct) buff += "'";
-	buff += ";";
+	if (SCAN_LIMIT == _scan_policy)
+	{
+		q.query += " LIMIT " + std::to_string(_scan_limit);
+		return LOOKUP_LIMITED;
+	}
 
-	load_selected_rows(tablename, buff);
+	if (first)
+		logger().warn("Lookup on unindexed column %s (estimated cost %g)",
+			what.c_str(), cost);
+	return LOOKUP_FULL;
+}
+
+/// Ask Postgres for the estimated total cost of a query. This is the
+/// upper cost of the top node of the plan, i.e. the number after the
+/// `..` in the first line, `Seq Scan on foo  (cost=0.00..1234.56 ...`
+double BridgeStorage::explain_cost(const LLQuery& q)
+{
+	_num_queries++;
+
+	std::vector<const char*> params;
+	for (const std::string& p : q.params)
+		params.push_back(p.c_str());
+
+	Response rp(conn_pool);
+	rp.exec_params("EXPLAIN " + q.query, params.size(), params.data(), false);
+
+	std::vector<std::string> plan;
+	rp.strvec = &plan;
+	rp.rs->foreach_row(&Response::strvec_cb, &rp);
+
+	if (0 == plan.size()) return -1.0;
+	size_t dots = plan[0].find("..");
+	if (std::string::npos == dots) return -1.0;
+	return strtod(plan[0].c_str() + dots + 2, nullptr);
+}
+
+/// Run a batch of lookups, all at once. The batch is split up across
+/// the connection pool, and each part is run in its own thread. Each
+/// part is pipelined on a single connection, so that it costs about
+/// one round-trip to the server, instead of one round-trip per lookup.
+/// Thus, the whole batch takes about as long as the slowest lookup.
+///
+/// All of the queries are made before any are sent; if the scan policy
+/// refuses a `direct` lookup, nothing at all is run. Lookups refused
+/// otherwise are dropped from the batch.
+void BridgeStorage::select_where(const std::vector<Lookup>& lookups,
+                                  bool direct)
+{
+	if (0 == lookups.size()) return;
+
+	// The same entry can show up in many rows of the same table;
+	// look it up only once. Skip the ones that were done recently.
+	std::vector<const Lookup*> unique;
+	std::set<MemoKey> seen;
+	for (const Lookup& lu : lookups)
+	{
+		MemoKey key(lu.tablename, lu.coldesc, lu.entry);
+		if (seen.insert(key).second and not memo_check(key))
+			unique.push_back(&lu);
+	}
+
+	// A planned lookup, with its query.
+	struct Planned
+	{
+		const Lookup* lu;
+		LLQuery query;
+		LookupKind kind;
+	};
+	std::vector<Planned> planned;
+	for (const Lookup* lu : unique)
+	{
+		Planned pl;
+		pl.lu = lu;
+		pl.kind = make_lookup(*lu, pl.query, direct);
+		if (LOOKUP_REFUSED != pl.kind)
+			planned.emplace_back(std::move(pl));
+	}
+	if (0 == planned.size()) return;
+
+	// Deal out the lookups, round-robin, one part per connection.
+	size_t nparts = std::min(planned.size(), conn_pool.max_size());
+	if (0 == nparts) nparts = 1;
+	std::vector<std::vector<const Planned*>> parts(nparts);
+	for (size_t i=0; i<planned.size(); i++)
+		parts[i % nparts].push_back(&planned[i]);
+
+	run_parallel(nparts, [&](size_t ip)
+	{
+		Clock::time_point start = Clock::now();
+		std::vector<LLQuery> queries;
+		for (const Planned* pl : parts[ip])
+			queries.push_back(pl->query);
+		_num_queries += queries.size();
+
+		Response rp(conn_pool);
+		rp.exec_pipeline(queries, _binary);
+
+		for (const Planned* pl : parts[ip])
+		{
+			const Lookup* lu = pl->lu;
+			rp.next_result();
+			make_rows(rp, lu->tablename);
+			if (LOOKUP_FULL == pl->kind)
+				memo_note({lu->tablename, lu->coldesc, lu->entry}, start);
+		}
+	});
 }
 
 /// Load rows from a single table, given just an entry in that row, a
@@ -273,9 +595,11 @@ HandleSeq BridgeStorage::load_rows(const Handle& tablename, // PredicateNode
 		throw RuntimeException(TRACE_INFO,
 			"Error: expecting the column name to be a VariableNode.\n");
 
-	HandleSeq colds(colname->getIncomingSetByType(TYPED_VARIABLE_LINK));
-	for (const Handle& coldesc : colds)
-		select_where(entry, coldesc, tablename);
+	std::vector<Lookup> lookups;
+	for (const ColumnDesc& cd : get_table(tablename)->columns)
+		if (cd.var == colname)
+			lookups.push_back({entry, cd.coldesc, tablename});
+	select_where(lookups, true);
 
 	// As a sop to the user, we're going to return what was found.
 	// Of course, they user could do this themselves. But, for now,
@@ -287,6 +611,7 @@ HandleSeq BridgeStorage::load_rows(const Handle& tablename, // PredicateNode
 		Handle maybe = _atom_space->get_link(EDGE_LINK, tablename, naked);
 		if (maybe) found.emplace_back(maybe);
 	}
+	touch_rows(found);
 
 	return found;
 }
@@ -295,25 +620,49 @@ HandleSeq BridgeStorage::load_rows(const Handle& tablename, // PredicateNode
 
 /// Given an single entry from some row in some table, and a column
 /// description for that entry, find all tables that same column name,
-/// and load the corresponding row from those tables.
+/// and plan lookups of the corresponding row from those tables.
 ///
 /// This is effectively assuming that `colname` is either a FOREIGN KEY
 /// or a PRIMARY KEY in some tables somewhere. We join *everything* with
 /// that key, and load it into the AtomSpace.
-void BridgeStorage::load_join(const Handle& entry,     // Concept or Number
-                               const Handle& coldesc)   // TypedVariable
+///
+/// If `_join_keys` is set, then only the declared FOREIGN KEY relations
+/// are followed, instead. If the column references a key in some other
+/// table, then that table is looked up, along with every other column
+/// referencing that same key. If it is itself a referenced key, then
+/// all of the referencing columns are looked up. Columns that are not
+/// part of any declared relation are not joined at all.
+void BridgeStorage::plan_join(const Handle& entry,     // Concept or Number
+                               const Handle& tablename, // PredicateNode
+                               const Handle& coldesc,   // TypedVariable
+                               std::vector<Lookup>& lookups)
 {
 	if (not coldesc->is_type(TYPED_VARIABLE_LINK))
 		throw RuntimeException(TRACE_INFO,
 			"Internal error, expecting a column description as a TypedVariable\n");
 
-	HandleSeq vlists(coldesc->getIncomingSetByType(VARIABLE_LIST));
-	for (const Handle& varli : vlists)
+	CatalogPtr cat(catalog());
+	if (_join_keys)
 	{
-		HandleSeq sigs(varli->getIncomingSetByType(SIGNATURE_LINK));
-		for (const Handle& sig : sigs)
-			select_where(entry, coldesc, sig->getOutgoingAtom(0));
+		ColKey origin(tablename, coldesc);
+		ColKey root(origin);
+		auto fk = cat->fkeys.find(origin);
+		if (cat->fkeys.end() != fk)
+		{
+			root = fk->second;
+			lookups.push_back({entry, root.second, root.first});
+		}
+
+		auto refs = cat->fkrefs.equal_range(root);
+		for (auto it = refs.first; it != refs.second; it++)
+			lookups.push_back({entry, it->second.second, it->second.first});
+		return;
 	}
+
+	auto it = cat->column_tables.find(coldesc);
+	if (cat->column_tables.end() == it) return;
+	for (const Handle& table : it->second)
+		lookups.push_back({entry, coldesc, table});
 }
 
 /// Given an single entry from some row in some table, find the column
@@ -326,7 +675,7 @@ void BridgeStorage::load_joined_rows(const Handle& entry)
 	// arow is of the form  (List (Concept "foo") (Concept "bar"))
 	// trow is (Edge (Predicate "table") arow)
 	// tablename is (Predicate "table")
-	// varli is (VariableList (TypedVariale ...) (TypedVariable ...))
+	// columns are the catalog entries for the (TypedVariable ...)'s
 	//
 	// The loops below start with (Concept "bar"), find all the tables
 	// it is in (there must be at least one, or this fails) and then
@@ -334,6 +683,10 @@ void BridgeStorage::load_joined_rows(const Handle& entry)
 	// Recall the (TypedVariable ...) is a column descriptor.
 	// This is sent upstream, to load all other rows having the same
 	// column descriptor and entry.
+	//
+	// All of the lookups are gathered up first, and then sent to the
+	// server in one batch.
+	std::vector<Lookup> lookups;
 	HandleSeq anonrows(entry->getIncomingSetByType(LIST_LINK));
 	for (const Handle& arow : anonrows)
 	{
@@ -341,15 +694,18 @@ void BridgeStorage::load_joined_rows(const Handle& entry)
 		for (const Handle& row : trows)
 		{
 			const Handle& tablename(row->getOutgoingAtom(0));
-			const Handle& varli(get_row_desc(tablename));
+			TableDescPtr td(get_table(tablename));
+			const std::vector<ColumnDesc>& columns(td->columns);
 			const HandleSeq& cols(arow->getOutgoingSet());
-			for (size_t i=0; i<cols.size(); i++)
+			for (size_t i=0; i<cols.size() and i<columns.size(); i++)
 			{
 				if (cols[i] == entry)
-					load_join(entry, varli->getOutgoingAtom(i));
+					plan_join(entry, tablename, columns[i].coldesc, lookups);
 			}
 		}
 	}
+
+	select_where(lookups);
 }
 
 /* ================================================================ */
@@ -392,22 +748,6 @@ void BridgeStorage::fetchIncomingByType(AtomSpace* as, const Handle& h, Type t)
 	fetchIncomingSet(as, h);
 }
 
-void BridgeStorage::storeAtom(const Handle&, bool synchronous)
-{
-}
-
-void BridgeStorage::removeAtom(AtomSpace*, const Handle&, bool recursive)
-{
-}
-
-void BridgeStorage::storeValue(const Handle& atom, const Handle& key)
-{
-}
-
-void BridgeStorage::updateValue(const Handle&, const Handle&, const ValuePtr&)
-{
-}
-
 void BridgeStorage::loadValue(const Handle& atom, const Handle& key)
 {
 }
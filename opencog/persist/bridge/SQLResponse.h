@@ -28,11 +28,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <string>
+#include <unordered_map>
+
 #include <opencog/atoms/base/Atom.h>
+#include <opencog/atoms/base/Link.h>
 #include <opencog/atomspace/AtomSpace.h>
+#include <opencog/atoms/core/NumberNode.h>
 #include <opencog/atoms/core/TypeNode.h>
 
 #include "llapi.h"
+#include "ll-pool.h"
 #include "BridgeStorage.h"
 
 using namespace opencog;
@@ -54,15 +60,68 @@ class BridgeStorage::Response
 		// Temporary cache of info about atom being assembled.
 
 	private:
-		concurrent_stack<LLConnection*>& _pool;
+		LLConnPool& _pool;
 		LLConnection* _conn;
 
+		// Results of a pipeline, not yet looked at.
+		std::vector<LLRecordSet*> _pending;
+		size_t _next;
+
+		// Set between begin() and commit(). The connection must not be
+		// swapped for another, then; that would lose the transaction.
+		bool _in_txn;
+
+		// Get an SQL connection, and run `query` on it. If the pool is
+		// empty, this will block, waiting for a connection to be
+		// returned to the pool. Thus, the size of the pool regulates
+		// how many outstanding SQL requests can be pending in parallel.
+		//
+		// If the connection breaks while the query is being sent, it
+		// is thrown away, and the query is tried once more, on another
+		// connection, unless it is part of a transaction. All writes
+		// are; a write that was cut off might still have been done by
+		// the server, and sending it again could do it twice. Failures
+		// of the query itself are passed on. A stream that breaks later,
+		// while its rows are being read, is not retried here; see
+		// load_selected_rows().
+		template<typename F> void run(F query)
+		{
+			if (rs) rs->release();
+			rs = nullptr;
+
+			if (nullptr == _conn) _conn = _pool.value_pop();
+			try
+			{
+				query();
+				if (rs or _conn->connected()) return;
+			}
+			catch (...)
+			{
+				if (_conn->connected() or _in_txn) throw;
+			}
+			if (_in_txn)
+				throw RuntimeException(TRACE_INFO,
+					"Lost the connection during a transaction");
+
+			_pool.discard(_conn);
+			_conn = nullptr;
+			_conn = _pool.value_pop();
+			query();
+		}
+
 	public:
-		Response(concurrent_stack<LLConnection*>& pool) :
+		Response(LLConnPool& pool) :
 			rs(nullptr),
 			_pool(pool),
 			_conn(nullptr),
-			intval(0)
+			_next(0),
+			_in_txn(false),
+			intval(0),
+			store(nullptr),
+			batch_max(1),
+			intern_max(0),
+			intern_hits(0),
+			intern_misses(0)
 		{}
 
 		~Response()
@@ -70,27 +129,41 @@ class BridgeStorage::Response
 			if (rs) rs->release();
 			rs = nullptr;
 
+			for (size_t i = _next; i < _pending.size(); i++)
+				_pending[i]->release();
+			_pending.clear();
+
+			// A transaction that was not committed failed somewhere;
+			// roll it back, so that the connection can be used again.
+			if (_in_txn and _conn)
+			{
+				try
+				{
+					LLRecordSet* rrs = _conn->exec("ROLLBACK;", true);
+					if (rrs) rrs->release();
+				}
+				catch (...) {}
+			}
+
 			// Put the SQL connection back into the pool.
 			if (_conn) _pool.push(_conn);
 			_conn = nullptr;
 		}
 
-		void exec(const char * buff)
+		// False if the connection broke. The Response can't be used
+		// any more, after that.
+		bool connected(void)
 		{
-			if (rs) rs->release();
+			return nullptr == _conn or _conn->connected();
+		}
 
-			// Get an SQL connection.  If the pool is empty, this will
-			// block, waiting for a connection to be returned to the pool.
-			// Thus, the size of the pool regulates how many outstanding
-			// SQL requests can be pending in parallel.
-			if (nullptr == _conn) _conn = _pool.value_pop();
-			rs = _conn->exec(buff, false);
+		void exec(const char * buff)
+		{
+			run([&](void) { rs = _conn->exec(buff, false); });
 		}
 		void try_exec(const char * buff)
 		{
-			if (rs) rs->release();
-			if (nullptr == _conn) _conn = _pool.value_pop();
-			rs = _conn->exec(buff, true);
+			run([&](void) { rs = _conn->exec(buff, true); });
 		}
 		void exec(const std::string& str)
 		{
@@ -101,6 +174,110 @@ class BridgeStorage::Response
 			try_exec(str.c_str());
 		}
 
+		// Same as exec(), but pull the rows from the server in batches
+		// of `nrows`. The rows can be processed as they arrive, and
+		// at most one batch is held in client RAM at any given time.
+		void stream(const std::string& str, size_t nrows, bool binary)
+		{
+			run([&](void) { rs = _conn->stream(str.c_str(), nrows, binary); });
+		}
+
+		// Same as stream(), but using the bulk-export path.
+		void copy_out(const std::string& str)
+		{
+			run([&](void) { rs = _conn->copy_out(str.c_str()); });
+		}
+
+		// Run everything up to commit() as one transaction, on one
+		// connection.
+		void begin(void)
+		{
+			exec("BEGIN;");
+			_in_txn = true;
+		}
+		void commit(void)
+		{
+			exec("COMMIT;");
+			_in_txn = false;
+		}
+
+		// Bulk-load rows with COPY FROM STDIN.
+		void copy_in(const std::string& copy, const std::string& data)
+		{
+			run([&](void) { _conn->copy_in(copy.c_str(), data); });
+		}
+
+		// Start a read-only transaction, and export its snapshot, so
+		// that queries on other connections can see exactly the same
+		// data; see use_snapshot(). The snapshot can be used for as
+		// long as this Response is around.
+		std::string export_snapshot(void)
+		{
+			exec("BEGIN ISOLATION LEVEL REPEATABLE READ, READ ONLY; "
+			     "SELECT pg_catalog.pg_export_snapshot();");
+			_in_txn = true;
+
+			std::vector<std::string> snap;
+			strvec = &snap;
+			rs->foreach_row(&Response::strvec_cb, this);
+			if (1 != snap.size())
+				throw RuntimeException(TRACE_INFO,
+					"Failed to export a snapshot");
+			return snap[0];
+		}
+
+		// Run everything up to the end of this Response in one read-only
+		// transaction, seeing the snapshot from export_snapshot().
+		void use_snapshot(const std::string& snap)
+		{
+			exec("BEGIN ISOLATION LEVEL REPEATABLE READ, READ ONLY; "
+			     "SET TRANSACTION SNAPSHOT '" + snap + "';");
+			_in_txn = true;
+		}
+
+		// Same as exec(), but with out-of-line parameters, and an
+		// optional binary-format result.
+		void exec_params(const std::string& str, int nparams,
+		                 const char * const * params, bool binary)
+		{
+			run([&](void) {
+				rs = _conn->exec_params(str.c_str(), nparams, params, binary);
+			});
+		}
+
+		// Run a prepared statement, preparing it first, if this
+		// connection has not seen it before.
+		void exec_prepared(const std::string& str,
+		                   int nparams, const char * const * params,
+		                   bool binary)
+		{
+			run([&](void) {
+				rs = _conn->exec_prepared(str.c_str(), nparams, params, binary);
+			});
+		}
+
+		// Send a whole batch of prepared statements at once. Step
+		// through the results with next_result().
+		void exec_pipeline(const std::vector<LLQuery>& queries, bool binary)
+		{
+			_next = 0;
+			_pending.clear();
+			run([&](void) {
+				_pending = _conn->exec_pipeline(queries, binary);
+			});
+		}
+
+		// Make the next pipeline result the current one. Returns
+		// false if there are no more.
+		bool next_result(void)
+		{
+			if (rs) rs->release();
+			rs = nullptr;
+			if (_pending.size() <= _next) return false;
+			rs = _pending[_next++];
+			return true;
+		}
+
 		// Generic things --------------------------------------------
 		// Get generic positive integer values
 		unsigned long intval;
@@ -133,111 +310,204 @@ class BridgeStorage::Response
 		}
 
 		// Table descriptions --------------------------------------------
+		// The catalog query returns one row per column, with the table
+		// name, column name, type name, whether the column is indexed,
+		// the table row count, page count and total bytes, whether the
+		// column is in the primary key, and the size of that key, in
+		// that order. The rows must be sorted by table, so that each
+		// table's columns are together. Only the columns of known types
+		// are kept; the rest of the descriptions are filled in by
+		// load_tables().
 		AtomSpace* as;
-		HandleSeq* tentries;
-		Handle vcol;
-		Handle tcol;
+		std::vector<TableDesc>* tdescs;
 		bool tabledesc_cb(void)
 		{
-			tcol = nullptr;
-			rs->foreach_column(&Response::table_column_cb, this);
-
-			// Add the var only if we know how to deal with the type
-			if (tcol)
+			const char* tabname = rs->get_column_value(0);
+			if (tdescs->empty() or tdescs->back().name.compare(tabname))
 			{
-				Handle tyv = as->add_link(TYPED_VARIABLE_LINK, vcol, tcol);
-				tentries->emplace_back(tyv);
+				tdescs->emplace_back();
+				TableDesc& td = tdescs->back();
+				td.name = tabname;
+				td.reltuples = atof(rs->get_column_value(4));
+				td.relpages = strtoul(rs->get_column_value(5), nullptr, 10);
+				td.total_bytes = strtoull(rs->get_column_value(6), nullptr, 10);
+
+				// NULL if there is no primary key.
+				td.npkey = strtoul(rs->get_column_value(8), nullptr, 10);
 			}
+
+			// Add the var only if we know how to deal with the type
+			const char* typname = rs->get_column_value(2);
+			Handle tcol = column_type(typname);
+			if (nullptr == tcol) return false;
+
+			TableDesc& td = tdescs->back();
+			ColumnDesc cd;
+			cd.name = rs->get_column_value(1);
+			cd.pgtype = typname;
+			cd.var = as->add_node(VARIABLE_NODE, std::string(cd.name));
+			cd.coldesc = as->add_link(TYPED_VARIABLE_LINK, cd.var, tcol);
+			cd.kind = TypeNodeCast(tcol)->get_kind();
+			cd.ordinal = td.columns.size();
+			cd.indexed = ('t' == rs->get_column_value(3)[0]);
+			cd.primary = ('t' == rs->get_column_value(7)[0]);
+			td.columns.emplace_back(std::move(cd));
 			return false;
 		}
-		bool table_column_cb(const char *colname, const char * colvalue)
+
+		// Return the TypeNode for an SQL type name, or null, if
+		// columns of this type are not supported.
+		Handle column_type(const char* typname)
 		{
-			if ('c' == colname[0])
+			if (!strcmp(typname, "text") or
+			    !strcmp(typname, "varchar"))
 			{
-				vcol = as->add_node(VARIABLE_NODE, std::string(colvalue));
+				return as->add_node(TYPE_NODE, "ConceptNode");
 			}
-			else if ('t' == colname[0])
+			if (!strcmp(typname, "int4") or
+			    !strcmp(typname, "int2") or
+			    !strcmp(typname, "int8") or
+			    !strcmp(typname, "float4") or
+			    !strcmp(typname, "float8") or
+			    !strcmp(typname, "bool"))
 			{
-				if (!strcmp(colvalue, "text") or
-				    !strcmp(colvalue, "varchar"))
-				{
-					tcol = as->add_node(TYPE_NODE, "ConceptNode");
-				}
-				else
-				if (!strcmp(colvalue, "int4") or
-				    !strcmp(colvalue, "int2") or
-				    !strcmp(colvalue, "int8") or
-				    !strcmp(colvalue, "float4") or
-				    !strcmp(colvalue, "float8") or
-				    !strcmp(colvalue, "bool"))
-				{
-					tcol = as->add_node(TYPE_NODE, "NumberNode");
-				}
-				else
-				if (!strcmp(colvalue, "timestamp") or
-				    !strcmp(colvalue, "date"))
-				{
-					// ignore, for now
-					tcol = nullptr;
-
-				}
-				else
-				if (!strcmp(colvalue, "bpchar"))
-				{
-					// In 'audit_chado' this is used as a binary true-false
-					// In 'feature' this is used for a hex md5sum
-					// ignore, for now
-					tcol = nullptr;
-
-				}
-				else
-				if (!strcmp(colvalue, "jsonb"))
-				{
-					// In 'allele_disease_variant'
-					// ignore, for now
-					tcol = nullptr;
-				}
-				else
-					printf("duuuude unknown coltype >>%s<<\n", colvalue);
+				return as->add_node(TYPE_NODE, "NumberNode");
 			}
-			return false;
+			if (!strcmp(typname, "timestamp") or
+			    !strcmp(typname, "date"))
+			{
+				// ignore, for now
+				return Handle::UNDEFINED;
+			}
+			if (!strcmp(typname, "bpchar"))
+			{
+				// In 'audit_chado' this is used as a binary true-false
+				// In 'feature' this is used for a hex md5sum
+				// ignore, for now
+				return Handle::UNDEFINED;
+			}
+			if (!strcmp(typname, "jsonb"))
+			{
+				// In 'allele_disease_variant'
+				// ignore, for now
+				return Handle::UNDEFINED;
+			}
+			printf("duuuude unknown coltype >>%s<<\n", typname);
+			return Handle::UNDEFINED;
 		}
 
 		// Table data --------------------------------------------
+		// Rows are assembled outside of the AtomSpace, and then added
+		// in batches of `batch_max`. The AtomSpace has no bulk insert,
+		// so a batch is still one add_atom() per row; but adding the
+		// EdgeLink also adds the ListLink under it, so each row takes
+		// one trip through the AtomSpace, instead of two.
+		//
+		// `kinds` is the table's compiled plan: the type of Atom to
+		// make for each column, by ordinal.
+		//
+		// If `store` is set, it is told about each batch of rows, so
+		// that it can keep track of them.
+		BridgeStorage* store;
 		Handle pred;
-		HandleSeq cols;
+		const Type* kinds;
+		size_t ncols;
 		HandleSeq elts;
+		HandleSeq batch;
+		size_t batch_max;
 		size_t it;
 		size_t nrows;
 		bool tabledata_cb(void)
 		{
-			it = 0;
+			if ((int) ncols != rs->get_column_count())
+				throw RuntimeException(TRACE_INFO,
+					"Internal Error: column count doesn't match the table");
+
 			elts.clear();
-			rs->foreach_column(&Response::table_row_cb, this);
+			for (it = 0; it < ncols; it++)
+			{
+				// Binary-format numbers arrive already decoded.
+				Type kind = kinds[it];
+				if (NUMBER_NODE == kind and rs->is_numeric_value(it))
+					elts.emplace_back(intern_number(rs->get_column_double(it)));
+				else
+					elts.emplace_back(intern_string(kind,
+						rs->get_column_value(it)));
+			}
 
 			// Add the col only if we know how to deal with the type
 			if (0 < elts.size())
 			{
-				Handle row = as->add_link(LIST_LINK, HandleSeq(elts));
-				as->add_link(EDGE_LINK, pred, row);
-				nrows++;
+				Handle row(createLink(HandleSeq(elts), LIST_LINK));
+				batch.emplace_back(createLink(EDGE_LINK, pred, row));
+				if (batch_max <= batch.size()) commit_batch();
 			}
 			return false;
 		}
-		bool table_row_cb(const char *colname, const char * colvalue)
+		void commit_batch(void)
 		{
-			// Fetch the AtomType from the TypeNode for this column.
-			const Handle& typed_var = cols.at(it);
-			if (typed_var->getOutgoingAtom(0)->get_name().compare(colname))
-				throw RuntimeException(TRACE_INFO,
-					"Intrnal Error: column names don't match");
+			for (Handle& edge : batch)
+				edge = as->add_atom(edge);
+			nrows += batch.size();
+			if (store) store->touch_rows(batch);
+			batch.clear();
+		}
 
-			TypeNodePtr tnp = TypeNodeCast(typed_var->getOutgoingAtom(1));
-			Handle h = as->add_node(tnp->get_kind(), colvalue);
-			elts.emplace_back(h);
+		// Intern cache --------------------------------------------
+		// Columns such as `type_id` or `is_obsolete` hold the same few
+		// values over and over. Remember the Atoms made for each column,
+		// so that repeats skip the AtomSpace lookup. Strings are keyed
+		// on the column text, exactly as it arrived; that is not always
+		// the Atom name (a NumberNode made from "3" is named "3.000000").
+		// The caches are bounded; once full, new values are not cached.
+		struct Intern
+		{
+			std::unordered_map<std::string, Handle> strs;
+			std::unordered_map<double, Handle> nums;
+		};
+		std::vector<Intern> interns;
+		size_t intern_max;
+		size_t intern_hits;
+		size_t intern_misses;
 
-			it++;
-			return false;
+		void intern_reset(size_t ncols, size_t max)
+		{
+			interns.clear();
+			interns.resize(ncols);
+			intern_max = max;
+		}
+
+		Handle intern_number(double d)
+		{
+			auto& cache = interns[it].nums;
+			auto hit = cache.find(d);
+			if (cache.end() != hit)
+			{
+				intern_hits++;
+				return hit->second;
+			}
+
+			intern_misses++;
+			Handle h(as->add_atom(createNumberNode(d)));
+			if (cache.size() < intern_max) cache.emplace(d, h);
+			return h;
+		}
+
+		Handle intern_string(Type kind, const char * colvalue)
+		{
+			auto& cache = interns[it].strs;
+			auto hit = cache.find(colvalue);
+			if (cache.end() != hit)
+			{
+				intern_hits++;
+				return hit->second;
+			}
+
+			intern_misses++;
+			Handle h(as->add_node(kind, colvalue));
+			if (cache.size() < intern_max)
+				cache.emplace(colvalue, h);
+			return h;
 		}
 
 
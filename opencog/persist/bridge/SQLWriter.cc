@@ -0,0 +1,845 @@
+/*
+ * FILE:
+ * opencog/persist/bridge/SQLWriter.cc
+ *
+ * FUNCTION:
+ * Write rows from the AtomSpace back to SQL tables.
+ *
+ * HISTORY:
+ * Copyright (c) 2022 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <cmath>
+
+#include <opencog/util/platform.h>
+#include <opencog/atoms/base/Node.h>
+#include <opencog/atoms/core/NumberNode.h>
+#include <opencog/atoms/value/FloatValue.h>
+#include <opencog/atoms/value/StringValue.h>
+
+#include "BridgeStorage.h"
+
+#include "SQLResponse.h"
+
+using namespace opencog;
+
+/* ================================================================ */
+// Rows are written with COPY FROM STDIN, in the text format. Each row
+// is one line; the columns are separated by tabs. Backslashes, tabs
+// and newlines in the values must be escaped.
+
+/// Append a number, converting it to the column's type.
+static void append_number(std::string& buf, const std::string& pgtype,
+                          double d)
+{
+	if (0 == pgtype.compare("bool"))
+		buf += (0.0 != d) ? "t" : "f";
+	else if (0 == pgtype.compare(0, 3, "int"))
+		buf += std::to_string((long long) d);
+	else
+	{
+		char num[32];
+		snprintf(num, sizeof(num), "%.17g", d);
+		buf += num;
+	}
+}
+
+/// Append one value to a row of COPY data, converting it to the
+/// column's type.
+static void append_value(std::string& buf, const std::string& pgtype,
+                         const Handle& h)
+{
+	if (h->is_type(NUMBER_NODE))
+	{
+		append_number(buf, pgtype, NumberNodeCast(h)->get_value());
+		return;
+	}
+
+	for (char c : h->get_name())
+	{
+		switch (c)
+		{
+			case '\\': buf += "\\\\"; break;
+			case '\t': buf += "\\t"; break;
+			case '\n': buf += "\\n"; break;
+			case '\r': buf += "\\r"; break;
+			default: buf += c;
+		}
+	}
+}
+
+/// Return true if the Atom `h` can be stored in the column `cd`.
+/// Numeric columns take only NumberNodes, and integer columns only
+/// whole numbers that fit; text columns take the name of any Node.
+bool BridgeStorage::fits_column(const ColumnDesc& cd, const Handle& h)
+{
+	if (NUMBER_NODE != cd.kind) return h->is_node();
+	if (not h->is_type(NUMBER_NODE)) return false;
+	return fits_number(cd.pgtype, NumberNodeCast(h)->get_value());
+}
+
+/// Return true if the number `d` can be stored in a column of the
+/// Postgres type `pgtype`. Integers must be whole, and in range.
+bool BridgeStorage::fits_number(const std::string& pgtype, double d)
+{
+	if (0 != pgtype.compare(0, 3, "int")) return true;
+
+	double lim = 9.2e18;
+	if (0 == pgtype.compare("int2")) lim = 32767.0;
+	else if (0 == pgtype.compare("int4")) lim = 2147483647.0;
+	return d == std::floor(d) and std::fabs(d) <= lim;
+}
+
+/// Return true if the Value `v` can be stored in the column `cd`, with
+/// store-value. Numeric columns take a FloatValue or a NumberNode, and
+/// text columns a StringValue or a Node. No Value at all is NULL.
+bool BridgeStorage::fits_value(const ColumnDesc& cd, const ValuePtr& v)
+{
+	if (nullptr == v) return true;
+	if (v->is_atom()) return fits_column(cd, HandleCast(v));
+	if (NUMBER_NODE != cd.kind) return v->is_type(STRING_VALUE);
+	if (not v->is_type(FLOAT_VALUE)) return false;
+
+	const std::vector<double>& fv(FloatValueCast(v)->value());
+	return 0 == fv.size() or fits_number(cd.pgtype, fv[0]);
+}
+
+/// Return the Atom `h` as a query parameter for the column `cd`. It
+/// must fit the column; see fits_column(). Numbers are written the
+/// same way as when they are stored, with all of their digits.
+std::string BridgeStorage::to_param(const ColumnDesc& cd, const Handle& h)
+{
+	if (not h->is_type(NUMBER_NODE)) return h->get_name();
+
+	std::string param;
+	append_number(param, cd.pgtype, NumberNodeCast(h)->get_value());
+	return param;
+}
+
+/// Return the COPY data for a batch of rows of one table.
+std::string BridgeStorage::copy_data(const TableDesc& td,
+                                     const std::set<Handle>& rows)
+{
+	std::string data;
+	for (const Handle& row : rows)
+	{
+		const HandleSeq& cells(row->getOutgoingAtom(1)->getOutgoingSet());
+		for (size_t i=0; i<cells.size(); i++)
+		{
+			if (0 < i) data += '\t';
+			append_value(data, td.columns[i].pgtype, cells[i]);
+		}
+		data += '\n';
+	}
+	return data;
+}
+
+/* ================================================================ */
+
+/// Queue a row for insertion into its table. The row must be of the
+/// form `(Edge (Predicate "table") (List ...))`, with the table one of
+/// the loaded tables (or a projection of one), and the List holding a
+/// value for each column, in the Signature order.
+///
+/// The row is checked here, and then added to the batch for its table;
+/// this returns without waiting for it to be written, unless
+/// `synchronous` is set. Each batch is sent with one COPY, by the next
+/// group commit, on the committer thread. A batch of `_write_rows`
+/// rows asks for that commit right away.
+/// Storing the same row twice, before it is sent, sends it only once.
+void BridgeStorage::storeAtom(const Handle& h, bool synchronous)
+{
+	if (not _is_open)
+		throw RuntimeException(TRACE_INFO,
+			"Error: can't store rows; StorageNode is not open!");
+
+	if (not h->is_type(EDGE_LINK) or 2 != h->get_arity())
+		throw RuntimeException(TRACE_INFO,
+			"Only table rows can be stored; got %s\n",
+			h->to_short_string().c_str());
+
+	const Handle& tablename(h->getOutgoingAtom(0));
+	const Handle& row(h->getOutgoingAtom(1));
+	TableDescPtr tdp(get_table(tablename));
+	const TableDesc& td(*tdp);
+	if (not row->is_type(LIST_LINK) or
+	    td.columns.size() != row->get_arity())
+		throw RuntimeException(TRACE_INFO,
+			"Row does not match the signature of table %s: %s\n",
+			td.name.c_str(), h->to_short_string().c_str());
+
+	// Check the values here, where the error can be thrown to the
+	// caller; a bad value sent in a batch would fail the whole batch.
+	const HandleSeq& cells(row->getOutgoingSet());
+	for (size_t i=0; i<cells.size(); i++)
+		if (not fits_column(td.columns[i], cells[i]))
+			throw RuntimeException(TRACE_INFO,
+				"Can't store %s in column %s of type %s\n",
+				cells[i]->to_short_string().c_str(),
+				td.columns[i].name.c_str(), td.columns[i].pgtype.c_str());
+
+	bool full = false;
+	{
+		std::lock_guard<std::mutex> lck(_write_mtx);
+		std::set<Handle>& queued(_write_batches[tablename]);
+		queued.insert(h);
+		full = (_write_rows <= queued.size());
+	}
+	if (full) kick_committer();
+	if (synchronous) barrier();
+}
+
+/// Group commit: send all of the pending writes in one transaction.
+/// These are the deletes, then the batches of new rows, one COPY per
+/// table, then the column updates. Postgres then has to flush its log
+/// to disk only once, instead of once per statement. The deletes and
+/// the new rows are sent in FOREIGN KEY order; see fk_order().
+///
+/// This is done at each barrier(), and by the committer, every
+/// `_commit_ms` milliseconds, or when `_write_rows` rows, updates or
+/// deletes are waiting; see kick_committer().
+///
+/// A new row whose key is already in the table is skipped, and counted
+/// as a duplicate; the rest of its table's batch is still written. To
+/// do this, each batch is copied into a staging table first, and then
+/// merged into its table with `ON CONFLICT DO NOTHING`.
+///
+/// Each statement is run under a savepoint. If one fails anyway, only
+/// the writes of that statement are dropped; the rest are still
+/// committed. If the connection is lost, all of the writes are
+/// dropped: some of them might have been done, and it can't be known
+/// which. The first error is held in `_write_error`, and thrown by the
+/// next barrier().
+void BridgeStorage::flushStoreQueue(void)
+{
+	// One at a time. Each commit takes everything written before it
+	// started, so a write is never sent in a later commit than one
+	// that was made after it. Within a commit, the order is fixed.
+	std::lock_guard<std::mutex> clck(_commit_mtx);
+
+	// The error is recorded while the commit is still held, so that a
+	// barrier() that waited for this commit finds it.
+	try { send_writes(); }
+	catch (...)
+	{
+		std::lock_guard<std::mutex> lck(_write_mtx);
+		if (not _write_error) _write_error = std::current_exception();
+	}
+}
+
+/// Send all of the pending writes, in one transaction, and throw the
+/// first error. The caller must hold `_commit_mtx`.
+void BridgeStorage::send_writes(void)
+{
+	std::map<Handle, std::set<Handle>> batches;
+	{
+		std::lock_guard<std::mutex> lck(_write_mtx);
+		batches.swap(_write_batches);
+	}
+	UpdateMap updates;
+	{
+		std::lock_guard<std::mutex> lck(_update_mtx);
+		updates.swap(_updates);
+	}
+	std::set<RowKey> deletes;
+	{
+		std::lock_guard<std::mutex> lck(_delete_mtx);
+		deletes.swap(_deletes);
+	}
+	if (batches.empty() and updates.empty() and deletes.empty()) return;
+
+	Stmts upd(update_stmts(updates));
+	Stmts del(delete_stmts(deletes));
+
+	// The new rows go in the reverse of the order of the deletes: each
+	// table after the tables that it references, so that the rows that
+	// they point at are there when the FOREIGN KEY is checked. A
+	// projection and its full table are the same SQL table.
+	CatalogPtr cat(catalog());
+	std::multimap<std::string, Handle> preds;
+	std::set<std::string> tables;
+	for (const auto& pr : batches)
+	{
+		auto it = cat->tables.find(pr.first);
+		std::string tab(cat->tables.end() == it ?
+			pr.first->get_name() : it->second->name);
+		preds.insert({tab, pr.first});
+		tables.insert(tab);
+	}
+	std::vector<std::string> order(fk_order(*cat, tables));
+	HandleSeq copies;
+	for (auto tab = order.rbegin(); tab != order.rend(); tab++)
+	{
+		auto rng = preds.equal_range(*tab);
+		for (auto it = rng.first; it != rng.second; it++)
+			copies.push_back(it->second);
+	}
+
+	_num_queries++;
+	Response rp(conn_pool);
+	std::exception_ptr eptr;
+	auto send = [&](const std::function<void(void)>& stmt)
+	{
+		rp.exec("SAVEPOINT bridge_write;");
+		try { stmt(); }
+		catch (...)
+		{
+			if (not rp.connected()) throw;
+			if (not eptr) eptr = std::current_exception();
+			rp.exec("ROLLBACK TO SAVEPOINT bridge_write;");
+			return false;
+		}
+		rp.exec("RELEASE SAVEPOINT bridge_write;");
+		return true;
+	};
+
+	size_t nstored = 0;
+	size_t nupdated = 0;
+	size_t ndeleted = 0;
+	rp.begin();
+	for (const auto& st : del)
+		if (send([&] { rp.exec(st.first); })) ndeleted += st.second;
+	for (const Handle& pred : copies)
+	{
+		const std::set<Handle>& rows(batches[pred]);
+		size_t nrows = 0;
+		bool ok = send([&] {
+			TableDescPtr td(get_table(*cat, pred));
+			rp.exec(td->stage);
+			rp.copy_in(td->copy, copy_data(*td, rows));
+			rp.exec(td->merge);
+			rp.rs->foreach_row(&Response::intval_cb, &rp);
+			nrows = rp.intval;
+			rp.exec("DROP TABLE bridge_stage;");
+		});
+		if (not ok) continue;
+		nstored += nrows;
+		_num_rows_skipped += rows.size() - nrows;
+		_num_copies++;
+	}
+	for (const auto& st : upd)
+		if (send([&] { rp.exec(st.first); })) nupdated += st.second;
+	rp.commit();
+
+	_num_rows_stored += nstored;
+	_num_deletes += ndeleted;
+	_num_commits++;
+	_num_commit_rows += nstored + nupdated + ndeleted;
+
+	if (eptr) std::rethrow_exception(eptr);
+}
+
+/// Run a group commit every `_commit_ms` milliseconds, and whenever
+/// kicked, until stopped. If `_commit_ms` is zero, only when kicked.
+/// Errors are held, and thrown by the next barrier(); see
+/// flushStoreQueue().
+void BridgeStorage::committer(void)
+{
+	set_thread_name("bridge:commit");
+	std::unique_lock<std::mutex> lck(_committer_mtx);
+	auto woken = [this] { return _committer_stop or _committer_kick; };
+	while (not _committer_stop)
+	{
+		if (0 == _commit_ms)
+			_committer_cv.wait(lck, woken);
+		else
+			_committer_cv.wait_for(lck,
+				std::chrono::milliseconds(_commit_ms), woken);
+		if (_committer_stop) break;
+		_committer_kick = false;
+
+		lck.unlock();
+		flushStoreQueue();
+		lck.lock();
+	}
+}
+
+void BridgeStorage::start_committer(void)
+{
+	if (_committer.joinable()) return;
+	_committer_stop = false;
+	_committer = std::thread(&BridgeStorage::committer, this);
+}
+
+void BridgeStorage::stop_committer(void)
+{
+	if (not _committer.joinable()) return;
+	{
+		std::lock_guard<std::mutex> lck(_committer_mtx);
+		_committer_stop = true;
+	}
+	_committer_cv.notify_all();
+	_committer.join();
+}
+
+/// Ask for a group commit now, instead of at the committer's next
+/// turn. This returns at once; the writes are sent by the committer.
+void BridgeStorage::kick_committer(void)
+{
+	{
+		std::lock_guard<std::mutex> lck(_committer_mtx);
+		_committer_kick = true;
+	}
+	_committer_cv.notify_all();
+}
+
+/// Return the number of rows waiting to be written.
+size_t BridgeStorage::queued_rows(void)
+{
+	size_t n = 0;
+	std::lock_guard<std::mutex> lck(_write_mtx);
+	for (const auto& pr : _write_batches)
+		n += pr.second.size();
+	return n;
+}
+
+/* ================================================================ */
+// Column updates.
+//
+// A Value placed on a row, under the key of one of its columns, is the
+// new value for that column: a FloatValue or a NumberNode for numeric
+// columns, and a StringValue or a ConceptNode for text columns. Only
+// the first entry of a vector is used. Thus
+//
+//    (cog-set-value! row (Variable "name") (StringValue "foo"))
+//    (store-value row (Variable "name"))
+//
+// becomes `UPDATE table SET name = 'foo' WHERE <key of row>`. The row
+// itself is not changed; it still names the row by its old contents,
+// until it is loaded again.
+//
+// Agents may change the same cell many times a second. So the updates
+// are not sent one at a time; only the newest value of each cell is
+// kept, until the next group commit. Then all of them are sent, in
+// the same transaction, with one
+//
+//    UPDATE table SET col = v.col
+//       FROM (VALUES (key, val), (key, val), ...) AS v (keycol, col)
+//       WHERE table.keycol = v.keycol;
+//
+// for each table and set of changed columns.
+
+/// Return a Value as an SQL literal of the column's type, such as
+/// `'42'::int4`. No Value at all is NULL.
+std::string BridgeStorage::sql_literal(const std::string& pgtype,
+                                       const ValuePtr& v)
+{
+	std::string text;
+	if (nullptr == v)
+		return "NULL::" + pgtype;
+	else if (v->is_type(FLOAT_VALUE))
+	{
+		const std::vector<double>& fv(FloatValueCast(v)->value());
+		if (0 == fv.size()) return "NULL::" + pgtype;
+		append_number(text, pgtype, fv[0]);
+	}
+	else if (v->is_type(NUMBER_NODE))
+		append_number(text, pgtype, NumberNodeCast(HandleCast(v))->get_value());
+	else if (v->is_type(STRING_VALUE))
+	{
+		const std::vector<std::string>& sv(StringValueCast(v)->value());
+		if (0 == sv.size()) return "NULL::" + pgtype;
+		text = sv[0];
+	}
+	else if (v->is_node())
+		text = HandleCast(v)->get_name();
+	else
+		throw RuntimeException(TRACE_INFO,
+			"Can't store %s in a column of type %s\n",
+			v->to_short_string().c_str(), pgtype.c_str());
+
+	escape_single_quotes(text);
+	return "'" + text + "'::" + pgtype;
+}
+
+/// Return the name of a row, as it is in SQL: the SQL table, and the
+/// literals for its primary key columns, by column name. A row and
+/// its projections have the same name.
+BridgeStorage::RowKey BridgeStorage::row_key(const TableDesc& td,
+                                             const Handle& row)
+{
+	const HandleSeq& cells(row->getOutgoingAtom(1)->getOutgoingSet());
+	RowKey rk;
+	rk.first = td.name;
+	for (size_t k : td.pkey)
+		rk.second[td.columns[k].name] =
+			sql_literal(td.columns[k].pgtype, cells[k]);
+	return rk;
+}
+
+/// Queue the Value on `row`, at `key`, as an update of one column.
+void BridgeStorage::queue_update(const Handle& row, const Handle& key)
+{
+	if (not _is_open)
+		throw RuntimeException(TRACE_INFO,
+			"Error: can't store values; StorageNode is not open!");
+
+	if (not row->is_type(EDGE_LINK) or 2 != row->get_arity())
+		throw RuntimeException(TRACE_INFO,
+			"Only the Values on table rows can be stored; got %s\n",
+			row->to_short_string().c_str());
+
+	TableDescPtr tdp(get_table(row->getOutgoingAtom(0)));
+	const TableDesc& td(*tdp);
+	const Handle& cells(row->getOutgoingAtom(1));
+	if (not cells->is_type(LIST_LINK) or
+	    td.columns.size() != cells->get_arity())
+		throw RuntimeException(TRACE_INFO,
+			"Row does not match the signature of table %s: %s\n",
+			td.name.c_str(), row->to_short_string().c_str());
+
+	if (0 == td.pkey.size())
+		throw RuntimeException(TRACE_INFO,
+			"Can't update rows of %s; it has no usable primary key\n",
+			td.name.c_str());
+
+	const ColumnDesc* col = nullptr;
+	for (const ColumnDesc& cd : td.columns)
+		if (cd.var == key or cd.coldesc == key) { col = &cd; break; }
+
+	if (nullptr == col)
+		throw RuntimeException(TRACE_INFO,
+			"Table %s has no column %s\n", td.name.c_str(),
+			key->to_short_string().c_str());
+
+	if (col->primary)
+		throw RuntimeException(TRACE_INFO,
+			"Can't update %s; it is part of the primary key of %s\n",
+			col->name.c_str(), td.name.c_str());
+
+	ValuePtr v(row->getValue(key));
+	if (not fits_value(*col, v))
+		throw RuntimeException(TRACE_INFO,
+			"Can't store %s in column %s of type %s\n",
+			v->to_short_string().c_str(),
+			col->name.c_str(), col->pgtype.c_str());
+
+	std::string lit(sql_literal(col->pgtype, v));
+	RowKey rk(row_key(td, row));
+
+	bool full = false;
+	{
+		std::lock_guard<std::mutex> lck(_update_mtx);
+		std::map<std::string, std::string>& cols(_updates[rk]);
+		auto it = cols.find(col->name);
+		if (cols.end() == it)
+			cols.emplace(col->name, std::move(lit));
+		else
+		{
+			it->second = std::move(lit);
+			_num_updates_absorbed++;
+		}
+		full = (_write_rows <= _updates.size());
+	}
+	_num_updates++;
+
+	if (full) kick_committer();
+}
+
+/// Return the UPDATE statements for the queued column updates.
+BridgeStorage::Stmts BridgeStorage::update_stmts(const UpdateMap& updates)
+{
+	// Rows of the same table, changing the same columns, go into the
+	// same UPDATE. The key is (table, key columns, changed columns).
+	typedef std::vector<std::string> Names;
+	std::map<std::tuple<std::string, Names, Names>,
+		std::vector<const UpdateMap::value_type*>> groups;
+	for (const auto& pr : updates)
+	{
+		Names kcols, cols;
+		for (const auto& kc : pr.first.second)
+			kcols.push_back(kc.first);
+		for (const auto& cell : pr.second)
+			cols.push_back(cell.first);
+		groups[std::make_tuple(pr.first.first, kcols, cols)].push_back(&pr);
+	}
+
+	Stmts cmds;
+	for (const auto& grp : groups)
+	{
+		const std::string& table(std::get<0>(grp.first));
+
+		std::string set, vcols, where;
+		for (const std::string& cn : std::get<1>(grp.first))
+		{
+			vcols += cn + ", ";
+			where += (where.empty() ? "" : " AND ") +
+				table + "." + cn + " = v." + cn;
+		}
+		for (const std::string& cn : std::get<2>(grp.first))
+		{
+			vcols += cn + ", ";
+			set += (set.empty() ? "" : ", ") + cn + " = v." + cn;
+		}
+		vcols.pop_back();
+		vcols.pop_back();
+
+		std::string values;
+		for (const auto* row : grp.second)
+		{
+			values += values.empty() ? "(" : ", (";
+			for (const auto& kc : row->first.second)
+				values += kc.second + ", ";
+			for (const auto& cell : row->second)
+				values += cell.second + ", ";
+			values.pop_back();
+			values.back() = ')';
+		}
+
+		cmds.push_back({"UPDATE " + table + " SET " + set +
+			" FROM (VALUES " + values + ") AS v (" + vcols + ")" +
+			" WHERE " + where + ";", grp.second.size()});
+		_num_update_stmts++;
+	}
+	return cmds;
+}
+
+void BridgeStorage::storeValue(const Handle& atom, const Handle& key)
+{
+	queue_update(atom, key);
+}
+
+/// The AtomSpace has already applied the change; the new value is
+/// queued, just as for storeValue.
+void BridgeStorage::updateValue(const Handle& atom, const Handle& key,
+                                const ValuePtr& delta)
+{
+	queue_update(atom, key);
+}
+
+/* ================================================================ */
+// Deletes.
+//
+// Removing a row from the AtomSpace, with `cog-delete!` and friends,
+// deletes it from its table. Removing some other Atom recursively
+// deletes all of the rows, in the AtomSpace, that hold it: removing
+// `(Concept "CG7069")` deletes every loaded row naming that gene.
+//
+// Rows are identified by their primary key. The deletes are queued,
+// and sent with one
+//
+//    DELETE FROM table WHERE keycol = ANY (ARRAY[key, key, ...]);
+//
+// per table, in the next group commit. The deletes are sent before the
+// new rows; a row that is deleted and then stored again is replaced.
+// A row that is stored and then deleted, before it is sent, is simply
+// not sent. Tables holding FOREIGN KEY references are done before the
+// tables that they reference; so, if the rows being deleted reference
+// one another, the references are gone by the time the rows they point
+// at are deleted.
+
+/// Collect the rows under `h`: the rows of the tables in `cat` that
+/// hold it, or `h` itself, if it is a row. The `seen` set stops the
+/// walk from visiting an Atom twice.
+void BridgeStorage::find_rows(const Catalog& cat, const Handle& h,
+                              HandleSet& seen, HandleSeq& rows)
+{
+	if (not seen.insert(h).second) return;
+
+	if (h->is_type(EDGE_LINK) and 2 == h->get_arity() and
+	    cat.tables.end() != cat.tables.find(h->getOutgoingAtom(0)))
+	{
+		rows.push_back(h);
+		return;
+	}
+
+	for (const Handle& hi : h->getIncomingSet())
+		find_rows(cat, hi, seen, rows);
+}
+
+/// Queue the rows for deletion. All of them are checked first; if any
+/// can't be deleted, none are, and nothing that is waiting to be
+/// written is changed.
+void BridgeStorage::queue_deletes(const Catalog& cat, const HandleSeq& rows)
+{
+	std::vector<RowKey> keys;
+	for (const Handle& h : rows)
+	{
+		TableDescPtr tdp(get_table(cat, h->getOutgoingAtom(0)));
+		const TableDesc& td(*tdp);
+		const Handle& cells(h->getOutgoingAtom(1));
+		if (not cells->is_type(LIST_LINK) or
+		    td.columns.size() != cells->get_arity())
+			throw RuntimeException(TRACE_INFO,
+				"Row does not match the signature of table %s: %s\n",
+				td.name.c_str(), h->to_short_string().c_str());
+
+		if (0 == td.pkey.size())
+			throw RuntimeException(TRACE_INFO,
+				"Can't delete rows of %s; it has no usable primary key\n",
+				td.name.c_str());
+
+		keys.emplace_back(row_key(td, h));
+	}
+
+	// Changes to a row that is going away are pointless, and so is
+	// inserting it, if that wasn't done yet.
+	{
+		std::lock_guard<std::mutex> lck(_write_mtx);
+		for (const Handle& h : rows)
+		{
+			auto it = _write_batches.find(h->getOutgoingAtom(0));
+			if (_write_batches.end() != it and it->second.erase(h) and
+			    it->second.empty())
+				_write_batches.erase(it);
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lck(_update_mtx);
+		for (const RowKey& rk : keys)
+		{
+			auto it = _updates.find(rk);
+			if (_updates.end() != it)
+			{
+				_num_updates_absorbed += it->second.size();
+				_updates.erase(it);
+			}
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lck(_lru_mtx);
+		for (const Handle& h : rows)
+		{
+			auto it = _lru_pos.find(h);
+			if (_lru_pos.end() != it)
+			{
+				_lru.erase(it->second);
+				_lru_pos.erase(it);
+			}
+		}
+	}
+
+	std::lock_guard<std::mutex> lck(_delete_mtx);
+	_deletes.insert(keys.begin(), keys.end());
+}
+
+void BridgeStorage::removeAtom(AtomSpace* as, const Handle& h,
+                               bool recursive)
+{
+	if (not _is_open)
+		throw RuntimeException(TRACE_INFO,
+			"Error: can't delete rows; StorageNode is not open!");
+
+	// Only rows are kept in tables; anything else is not stored, and
+	// there is nothing to do, unless it is part of some rows.
+	bool is_row = h->is_type(EDGE_LINK);
+	if (not is_row and not recursive) return;
+
+	CatalogPtr cat(catalog());
+	HandleSet seen;
+	HandleSeq rows;
+	find_rows(*cat, h, seen, rows);
+	queue_deletes(*cat, rows);
+
+	size_t ndel = 0;
+	{
+		std::lock_guard<std::mutex> lck(_delete_mtx);
+		ndel = _deletes.size();
+	}
+	if (_write_rows <= ndel) kick_committer();
+}
+
+/// Return the DELETE statements for the queued deletes, in an order
+/// that respects the FOREIGN KEY references.
+/// Return the SQL `tables` in FOREIGN KEY order: each table comes
+/// before all of the tables that it references, that is, a table is
+/// placed only after the tables referencing it. Reference cycles can't
+/// be ordered; they are broken at some arbitrary point. Deletes are
+/// done in this order; new rows in the reverse order.
+std::vector<std::string>
+BridgeStorage::fk_order(const Catalog& cat,
+                        const std::set<std::string>& tables)
+{
+	std::multimap<std::string, std::string> refs;
+	for (const auto& fk : cat.fkeys)
+	{
+		const std::string& from(get_table(cat, fk.first.first)->name);
+		const std::string& to(get_table(cat, fk.second.first)->name);
+		if (from != to and tables.count(from) and tables.count(to))
+			refs.insert({to, from});
+	}
+
+	std::vector<std::string> order;
+	std::set<std::string> done;
+	std::function<void(const std::string&, std::set<std::string>&)> visit =
+		[&](const std::string& tab, std::set<std::string>& path)
+	{
+		if (done.count(tab) or not path.insert(tab).second) return;
+		auto rng = refs.equal_range(tab);
+		for (auto it = rng.first; it != rng.second; it++)
+			visit(it->second, path);
+		path.erase(tab);
+		if (done.insert(tab).second) order.push_back(tab);
+	};
+	for (const std::string& tab : tables)
+	{
+		std::set<std::string> path;
+		visit(tab, path);
+	}
+	return order;
+}
+
+BridgeStorage::Stmts BridgeStorage::delete_stmts(const std::set<RowKey>& deletes)
+{
+	// Group the rows by SQL table; a projection and its full table
+	// are the same table. The key columns of a RowKey are in the order
+	// of their names, so they line up for every row in a group, no
+	// matter which Atom named the row.
+	std::map<std::string, std::vector<const RowKey*>> rows;
+	for (const RowKey& rk : deletes)
+		rows[rk.first].push_back(&rk);
+
+	// Each table goes before all of the tables that it references.
+	std::set<std::string> tables;
+	for (const auto& pr : rows)
+		tables.insert(pr.first);
+
+	Stmts cmds;
+	for (const std::string& tab : fk_order(*catalog(), tables))
+	{
+		const std::vector<const RowKey*>& trows(rows[tab]);
+		size_t nkey = trows[0]->second.size();
+
+		std::string kcols, kvals;
+		for (const auto& kc : trows[0]->second)
+			kcols += (kcols.empty() ? "" : ", ") + kc.first;
+		for (const RowKey* rk : trows)
+		{
+			std::string key;
+			for (const auto& kc : rk->second)
+				key += (key.empty() ? "" : ", ") + kc.second;
+			kvals += (kvals.empty() ? "" : ", ") +
+				(1 == nkey ? key : "(" + key + ")");
+		}
+
+		if (1 == nkey)
+			cmds.push_back({"DELETE FROM " + tab + " WHERE " + kcols +
+				" = ANY (ARRAY[" + kvals + "]);", trows.size()});
+		else
+			cmds.push_back({"DELETE FROM " + tab + " WHERE (" + kcols +
+				") IN (VALUES " + kvals + ");", trows.size()});
+		_num_delete_stmts++;
+	}
+	return cmds;
+}
+
+/* ============================= END OF FILE ================= */
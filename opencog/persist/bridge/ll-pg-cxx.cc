@@ -29,6 +29,11 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <algorithm>
+#include <exception>
+
+#include <arpa/inet.h>
+#include <endian.h>
 #include <postgresql/libpq-fe.h>
 
 #include <opencog/util/exceptions.h>
@@ -42,6 +47,7 @@
 LLPGConnection::LLPGConnection(const char * uri)
 {
 	is_connected = false;
+	_stmt_seq = 0;
 
 	_pgconn = PQconnectdb(uri);
 
@@ -63,9 +69,33 @@ LLPGConnection::~LLPGConnection()
 	PQfinish(_pgconn);
 }
 
+/* =========================================================== */
+
+/// Check the connection status, as last seen by libpq. If it went
+/// bad, try to reset it. Prepared statements do not survive a reset.
+bool LLPGConnection::check(void)
+{
+	if (is_connected and CONNECTION_OK == PQstatus(_pgconn))
+		return true;
+
+	PQreset(_pgconn);
+	_prepared.clear();
+	is_connected = (CONNECTION_OK == PQstatus(_pgconn));
+	return is_connected;
+}
+
 /* =========================================================== */
 #define DEFAULT_NUM_COLS 20
 
+// Type OID's, from the Postgres server header `catalog/pg_type_d.h`,
+// which is not installed with the client library.
+#define BOOLOID 16
+#define INT8OID 20
+#define INT2OID 21
+#define INT4OID 23
+#define FLOAT4OID 700
+#define FLOAT8OID 701
+
 LLPGRecordSet * LLPGConnection::get_record_set(void)
 {
 	LLPGRecordSet *rs;
@@ -88,6 +118,40 @@ LLPGRecordSet * LLPGConnection::get_record_set(void)
 
 /* =========================================================== */
 
+void
+LLPGConnection::check_result(PGresult* result, const char * buff,
+                             bool trial_run)
+{
+	ExecStatusType rest = PQresultStatus(result);
+	if (rest == PGRES_COMMAND_OK or
+	    rest == PGRES_EMPTY_QUERY or
+	    rest == PGRES_TUPLES_OK)
+		return;
+
+	// Don't log trial-run failures. Just throw.
+	if (trial_run and PGRES_FATAL_ERROR == rest)
+		throw opencog::SilentException();
+
+	std::string msg;
+	if (PQstatus(_pgconn) != CONNECTION_OK)
+	{
+		is_connected = false;
+		msg = "No connection to the database!";
+	}
+	else
+	{
+		msg = "PQresult message: ";
+		msg += PQresultErrorMessage(result);
+		msg += "\nPQ query was: ";
+		msg += buff;
+	}
+
+	opencog::logger().warn("%s", msg.c_str());
+
+	throw opencog::RuntimeException(TRACE_INFO,
+		"Failed to execute SQL command!\n%s", msg.c_str());
+}
+
 LLRecordSet *
 LLPGConnection::exec(const char * buff, bool trial_run)
 {
@@ -97,46 +161,384 @@ LLPGConnection::exec(const char * buff, bool trial_run)
 
 	rs->_result = PQexec(_pgconn, buff);
 
-	ExecStatusType rest = PQresultStatus(rs->_result);
-	if (rest != PGRES_COMMAND_OK and
-	    rest != PGRES_EMPTY_QUERY and
-	    rest != PGRES_TUPLES_OK)
+	try
+	{
+		check_result(rs->_result, buff, trial_run);
+	}
+	catch (...)
 	{
-		// Don't log trial-run failures. Just throw.
-		if (trial_run and PGRES_FATAL_ERROR == rest)
+		rs->release();
+		throw;
+	}
+
+	/* Use numbr of columns to indicate that the query hasn't
+	 * given results yet. */
+	rs->ncols = -1;
+	return rs;
+}
+
+/* =========================================================== */
+
+/// Run a query with out-of-line parameters. If `binary` is set,
+/// then the server is asked to send results in binary format; the
+/// record set will decode numeric columns directly into doubles.
+LLRecordSet *
+LLPGConnection::exec_params(const char * buff, int nparams,
+                            const char * const * params, bool binary)
+{
+	if (!is_connected) return NULL;
+
+	LLPGRecordSet* rs = get_record_set();
+	rs->_binary = binary;
+
+	rs->_result = PQexecParams(_pgconn, buff, nparams,
+		nullptr, params, nullptr, nullptr, binary ? 1 : 0);
+
+	try
+	{
+		check_result(rs->_result, buff, false);
+	}
+	catch (...)
+	{
+		rs->release();
+		throw;
+	}
+
+	rs->ncols = -1;
+	return rs;
+}
+
+/* =========================================================== */
+
+/// Run the `query` as a prepared statement, preparing it first, if it
+/// has not yet been prepared on this connection. The parameters are
+/// passed out-of-line, so they never need quoting.
+LLRecordSet *
+LLPGConnection::exec_prepared(const char * query,
+                              int nparams, const char * const * params,
+                              bool binary)
+{
+	if (!is_connected) return NULL;
+
+	auto pit = _prepared.find(query);
+	if (_prepared.end() == pit)
+	{
+		std::string pgname = "bridge_" + std::to_string(_stmt_seq++);
+		PGresult* res = PQprepare(_pgconn, pgname.c_str(), query,
+		                          nparams, nullptr);
+		try
+		{
+			check_result(res, query, false);
+		}
+		catch (...)
 		{
-			rs->release();
-			throw opencog::SilentException();
+			PQclear(res);
+			throw;
 		}
+		PQclear(res);
+		pit = _prepared.emplace(query, pgname).first;
+	}
+
+	LLPGRecordSet* rs = get_record_set();
+	rs->_binary = binary;
+
+	rs->_result = PQexecPrepared(_pgconn, pit->second.c_str(), nparams,
+		params, nullptr, nullptr, binary ? 1 : 0);
+
+	try
+	{
+		check_result(rs->_result, query, false);
+	}
+	catch (...)
+	{
+		rs->release();
+		throw;
+	}
+
+	rs->ncols = -1;
+	return rs;
+}
+
+/* =========================================================== */
 
-		std::string msg;
-		if (PQstatus(_pgconn) != CONNECTION_OK)
+/// Run a batch of prepared statements in libpq pipeline mode. All of
+/// the queries are sent before any of the results are read, so the
+/// whole batch costs about one network round-trip, instead of one per
+/// query. If libpq is too old to support pipelines (it needs to be
+/// version 14 or newer), the queries are run one at a time.
+///
+/// The queries are assumed to be small lookups; the socket is left
+/// in blocking mode, so the batch must be small enough to not fill
+/// the socket buffers while it is being sent.
+std::vector<LLRecordSet*>
+LLPGConnection::exec_pipeline(const std::vector<LLQuery>& queries,
+                              bool binary)
+{
+	std::vector<LLRecordSet*> rsv;
+	if (!is_connected) return rsv;
+
+	auto run_serially = [&](void)
+	{
+		try
+		{
+			for (const LLQuery& q : queries)
+			{
+				std::vector<const char*> pv;
+				for (const std::string& p : q.params) pv.push_back(p.c_str());
+				rsv.push_back(exec_prepared(q.query.c_str(),
+					pv.size(), pv.data(), binary));
+			}
+		}
+		catch (...)
 		{
-			msg = "No connection to the database!";
+			for (LLRecordSet* rs : rsv) rs->release();
+			throw;
 		}
+		return rsv;
+	};
+
+#ifndef LIBPQ_HAS_PIPELINING
+	return run_serially();
+#else
+	if (queries.size() < 2 or 0 == PQenterPipelineMode(_pgconn))
+		return run_serially();
+
+	// Send everything. Statements not yet prepared on this connection
+	// get a prepare step queued just ahead of them. Results come back
+	// in the same order, one for each step.
+	std::vector<const char*> steps;  // Query text, or null if a prepare.
+	std::map<std::string, std::string> preparing;
+	for (const LLQuery& q : queries)
+	{
+		const std::string* pgname;
+		auto pit = _prepared.find(q.query);
+		if (_prepared.end() != pit)
+			pgname = &pit->second;
 		else
 		{
-			msg = "PQresult message: ";
-			msg += PQresultErrorMessage(rs->_result);
-			msg += "\nPQ query was: ";
-			msg += buff;
+			auto npit = preparing.find(q.query);
+			if (preparing.end() == npit)
+			{
+				std::string nm = "bridge_" + std::to_string(_stmt_seq++);
+				PQsendPrepare(_pgconn, nm.c_str(), q.query.c_str(),
+					q.params.size(), nullptr);
+				npit = preparing.emplace(q.query, nm).first;
+				steps.push_back(nullptr);
+			}
+			pgname = &npit->second;
 		}
-		rs->release();
 
-		opencog::logger().warn("%s", msg.c_str());
+		std::vector<const char*> pv;
+		for (const std::string& p : q.params) pv.push_back(p.c_str());
+		PQsendQueryPrepared(_pgconn, pgname->c_str(), pv.size(),
+			pv.data(), nullptr, nullptr, binary ? 1 : 0);
+		steps.push_back(q.query.c_str());
+	}
+	PQpipelineSync(_pgconn);
 
+	// Drain. Each step delivers one result, followed by a null.
+	// If one step fails, all later steps report PIPELINE_ABORTED;
+	// keep draining anyway, so that the connection stays usable.
+	std::string errmsg;
+	for (const char* query : steps)
+	{
+		PGresult* res = PQgetResult(_pgconn);
+		while (PGresult* extra = PQgetResult(_pgconn)) PQclear(extra);
+
+		if (errmsg.empty())
+		{
+			try
+			{
+				if (nullptr == res)
+					throw opencog::RuntimeException(TRACE_INFO,
+						"Pipeline lost its connection");
+				check_result(res, query ? query : "(prepare)", false);
+			}
+			catch (const opencog::StandardException& ex)
+			{
+				errmsg = ex.get_message();
+			}
+		}
+
+		if (nullptr == query or not errmsg.empty())
+		{
+			PQclear(res);
+			continue;
+		}
+
+		LLPGRecordSet* rs = get_record_set();
+		rs->_binary = binary;
+		rs->_result = res;
+		rs->ncols = -1;
+		rsv.push_back(rs);
+	}
+
+	// Eat the sync marker.
+	PQclear(PQgetResult(_pgconn));
+	PQexitPipelineMode(_pgconn);
+
+	if (not errmsg.empty())
+	{
+		for (LLRecordSet* rs : rsv) rs->release();
 		throw opencog::RuntimeException(TRACE_INFO,
-			"Failed to execute SQL command!\n%s", msg.c_str());
+			"Failed to execute SQL pipeline!\n%s", errmsg.c_str());
+	}
+
+	// Only now are the new statements known to be prepared. (If the
+	// batch failed, some of them might be; the names are not reused.)
+	_prepared.insert(preparing.begin(), preparing.end());
+	return rsv;
+#endif // LIBPQ_HAS_PIPELINING
+}
+
+/* =========================================================== */
+
+#define CURSOR_NAME "bridge_cursor"
+
+/// Run the query through a server-side cursor, pulling `nrows` rows
+/// at a time. This keeps libpq from buffering the entire result in
+/// client RAM before the first row can be looked at. The cursor
+/// lives inside of a transaction; the transaction is closed when the
+/// record set is released. If a transaction is already open on this
+/// connection, the cursor uses it, and only the cursor is closed.
+LLRecordSet *
+LLPGConnection::stream(const char * buff, size_t nrows, bool binary)
+{
+	if (!is_connected) return NULL;
+
+	bool in_txn = (PQTRANS_INTRANS == PQtransactionStatus(_pgconn));
+	std::string decl = in_txn ? "" : "BEGIN READ ONLY; ";
+	decl += "DECLARE " CURSOR_NAME " NO SCROLL CURSOR FOR ";
+	decl += buff;
+
+	LLPGRecordSet* rs = get_record_set();
+	rs->_fetch = "FETCH " + std::to_string(nrows) + " FROM " CURSOR_NAME ";";
+	rs->_close = in_txn ? "CLOSE " CURSOR_NAME ";" : "ROLLBACK;";
+	rs->_batch = nrows;
+	rs->_binary = binary;
+
+	rs->_result = PQexec(_pgconn, decl.c_str());
+	try
+	{
+		check_result(rs->_result, decl.c_str(), false);
+		rs->fetch_batch();
+	}
+	catch (...)
+	{
+		rs->release();
+		throw;
+	}
+
+	rs->ncols = -1;
+	return rs;
+}
+
+/* =========================================================== */
+
+/// Bulk-load the results of a SELECT, using `COPY (SELECT ...) TO
+/// STDOUT` in binary format. This is the fastest way of getting large
+/// amounts of data out of Postgres. Rows are handed over one at a
+/// time, as they arrive, so client RAM use stays small.
+///
+/// Binary COPY does not say what the column types are, so the SELECT
+/// is first described (but not run), to find out.
+LLRecordSet *
+LLPGConnection::copy_out(const char * select)
+{
+	if (!is_connected) return NULL;
+
+	// COPY does not want the trailing semicolon.
+	std::string sel(select);
+	while (0 < sel.size() and (';' == sel.back() or ' ' == sel.back()))
+		sel.pop_back();
+
+	LLPGRecordSet* rs = get_record_set();
+	rs->_binary = true;
+	rs->_copy = true;
+
+	try
+	{
+		PGresult* res = PQprepare(_pgconn, "", sel.c_str(), 0, nullptr);
+		try { check_result(res, sel.c_str(), false); }
+		catch (...) { PQclear(res); throw; }
+		PQclear(res);
+
+		rs->_result = PQdescribePrepared(_pgconn, "");
+		check_result(rs->_result, sel.c_str(), false);
+
+		std::string copy = "COPY (" + sel + ") TO STDOUT (FORMAT binary);";
+		res = PQexec(_pgconn, copy.c_str());
+		if (PGRES_COPY_OUT != PQresultStatus(res))
+		{
+			try { check_result(res, copy.c_str(), false); }
+			catch (...) { PQclear(res); throw; }
+			PQclear(res);
+			throw opencog::RuntimeException(TRACE_INFO,
+				"Expecting COPY OUT for %s", copy.c_str());
+		}
+		PQclear(res);
+		rs->_copy_active = true;
+	}
+	catch (...)
+	{
+		rs->release();
+		throw;
 	}
 
-	/* Use numbr of columns to indicate that the query hasn't
-	 * given results yet. */
 	rs->ncols = -1;
 	return rs;
 }
 
 /* =========================================================== */
 
+// Size of the pieces in which COPY data is handed to libpq.
+#define COPY_CHUNK (256*1024)
+
+/// Bulk-load rows with `COPY table (cols) FROM STDIN`. The `data` must
+/// be in the COPY text format: one row per line, with tab-separated,
+/// escaped columns. The rows are streamed to the server without
+/// waiting for a reply; there is one round-trip at the end, when the
+/// server says whether the whole batch went in.
+void
+LLPGConnection::copy_in(const char * copy, const std::string& data)
+{
+	if (!is_connected)
+		throw opencog::RuntimeException(TRACE_INFO,
+			"No connection to the database!");
+
+	PGresult* res = PQexec(_pgconn, copy);
+	if (PGRES_COPY_IN != PQresultStatus(res))
+	{
+		try { check_result(res, copy, false); }
+		catch (...) { PQclear(res); throw; }
+		PQclear(res);
+		throw opencog::RuntimeException(TRACE_INFO,
+			"Expecting COPY IN for %s", copy);
+	}
+	PQclear(res);
+
+	int rc = 1;
+	for (size_t off = 0; off < data.size() and 1 == rc; off += COPY_CHUNK)
+	{
+		size_t len = std::min((size_t) COPY_CHUNK, data.size() - off);
+		rc = PQputCopyData(_pgconn, data.data() + off, len);
+	}
+	PQputCopyEnd(_pgconn, (1 == rc) ? nullptr : "failed sending data");
+
+	// The final result says if the COPY worked. Drain everything, so
+	// that the connection is ready for the next query.
+	std::exception_ptr eptr;
+	while (nullptr != (res = PQgetResult(_pgconn)))
+	{
+		try { if (not eptr) check_result(res, copy, false); }
+		catch (...) { eptr = std::current_exception(); }
+		PQclear(res);
+	}
+	if (eptr) std::rethrow_exception(eptr);
+}
+
+/* =========================================================== */
+
 void
 LLPGRecordSet::setup_cols(int new_ncols)
 {
@@ -150,6 +552,17 @@ LLPGRecordSet::setup_cols(int new_ncols)
 	values = new char*[new_ncols];
 	memset(values, 0, new_ncols * sizeof(char*));
 
+	if (dvalues) delete[] dvalues;
+	dvalues = new double[new_ncols];
+
+	if (column_datatype) delete[] column_datatype;
+	column_datatype = new int[new_ncols];
+	memset(column_datatype, 0, new_ncols * sizeof(int));
+
+	if (vsizes) delete[] vsizes;
+	vsizes = new int[new_ncols];
+	memset(vsizes, 0, new_ncols * sizeof(int));
+
    arrsize = new_ncols;
 }
 
@@ -163,6 +576,12 @@ LLPGRecordSet::LLPGRecordSet(LLPGConnection* _conn)
 	_result = nullptr;
 	_nrows = -1;
 	_curr_row = -1;
+	_batch = 0;
+	_binary = false;
+	_copy = false;
+	_copy_active = false;
+	_copy_header = false;
+	_copybuf = nullptr;
 }
 
 /* =========================================================== */
@@ -175,6 +594,47 @@ LLPGRecordSet::release(void)
 	_nrows = -1;
 	_curr_row = -1;
 	ncols = -1;
+
+	// Rolling back ends the transaction, and closes the cursor.
+	// This is harmless, even if the transaction was aborted. If the
+	// transaction is not ours, only the cursor is closed; if that
+	// fails, the transaction was aborted, and its owner rolls it back.
+	if (not _fetch.empty())
+	{
+		LLPGConnection* pgc = static_cast<LLPGConnection*>(conn);
+		PQclear(PQexec(pgc->_pgconn, _close.c_str()));
+		_fetch.clear();
+		_close.clear();
+		_batch = 0;
+	}
+
+	// If a COPY is still running, cancel it, and drain what's left,
+	// so that the connection is usable again.
+	if (_copy_active)
+	{
+		LLPGConnection* pgc = static_cast<LLPGConnection*>(conn);
+		PGcancel* cancel = PQgetCancel(pgc->_pgconn);
+		if (cancel)
+		{
+			char errbuf[256];
+			PQcancel(cancel, errbuf, sizeof(errbuf));
+			PQfreeCancel(cancel);
+		}
+		if (_copybuf) PQfreemem(_copybuf);
+		_copybuf = nullptr;
+		while (0 <= PQgetCopyData(pgc->_pgconn, &_copybuf, 0))
+		{
+			PQfreemem(_copybuf);
+			_copybuf = nullptr;
+		}
+		PGresult* res;
+		while ((res = PQgetResult(pgc->_pgconn))) PQclear(res);
+	}
+	if (_copybuf) PQfreemem(_copybuf);
+	_copybuf = nullptr;
+	_copy = false;
+	_copy_active = false;
+	_copy_header = false;
 	memset(column_labels, 0, arrsize * sizeof(char*));
 	memset(values, 0, arrsize * sizeof(char*));
 	LLRecordSet::release();
@@ -201,10 +661,225 @@ LLPGRecordSet::get_column_labels(void)
 	 */
 
 	ncols = PQnfields(_result);
+	setup_cols(ncols);
 	for (int i=0; i<ncols; i++)
 	{
 		column_labels[i] = PQfname(_result, i);
 	}
+
+	// Binary-format numbers will be decoded by us.
+	for (int i=0; i<ncols; i++)
+	{
+		column_datatype[i] = LL_TEXT_COLUMN;
+		if (not _binary) continue;
+		if (not _copy and 1 != PQfformat(_result, i)) continue;
+		switch (PQftype(_result, i))
+		{
+			case BOOLOID:
+			case INT2OID:
+			case INT4OID:
+			case INT8OID:
+			case FLOAT4OID:
+			case FLOAT8OID:
+				column_datatype[i] = LL_NUMERIC_COLUMN;
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+/* =========================================================== */
+
+/// Decode one binary-format number, in network byte order. Types
+/// that are not numbers decode as zero.
+double LLPGRecordSet::decode_number(Oid type, const char* v)
+{
+	// Values are not necessarily aligned; memcpy them out.
+	switch (type)
+	{
+		case BOOLOID:
+			return (0 != v[0]) ? 1.0 : 0.0;
+		case INT2OID:
+		{
+			uint16_t u; memcpy(&u, v, sizeof(u));
+			return (int16_t) be16toh(u);
+		}
+		case INT4OID:
+		{
+			uint32_t u; memcpy(&u, v, sizeof(u));
+			return (int32_t) be32toh(u);
+		}
+		case INT8OID:
+		{
+			uint64_t u; memcpy(&u, v, sizeof(u));
+			return (int64_t) be64toh(u);
+		}
+		case FLOAT4OID:
+		{
+			uint32_t u; memcpy(&u, v, sizeof(u));
+			u = be32toh(u);
+			float f; memcpy(&f, &u, sizeof(f));
+			return f;
+		}
+		case FLOAT8OID:
+		{
+			uint64_t u; memcpy(&u, v, sizeof(u));
+			u = be64toh(u);
+			double d; memcpy(&d, &u, sizeof(d));
+			return d;
+		}
+	}
+	return 0.0;
+}
+
+/// Decode one binary-format value into `dvalues`. SQL NULL's are
+/// passed on as empty strings, the same way that text-format results
+/// would have them.
+void
+LLPGRecordSet::decode_value(int i)
+{
+	const char* v = PQgetvalue(_result, _curr_row, i);
+	values[i] = (char*) v;
+	if (LL_NUMERIC_COLUMN != column_datatype[i]) return;
+
+	// Rare. Fall back to text for this one value.
+	vsizes[i] = PQgetisnull(_result, _curr_row, i) ? -1 : 0;
+	if (vsizes[i] < 0) return;
+
+	dvalues[i] = decode_number(PQftype(_result, i), v);
+}
+
+/* =========================================================== */
+
+/// Read one big-endian integer out of a COPY buffer.
+static int32_t copy_int32(const char*& p)
+{
+	uint32_t u; memcpy(&u, p, sizeof(u));
+	p += sizeof(u);
+	return (int32_t) be32toh(u);
+}
+
+static int16_t copy_int16(const char*& p)
+{
+	uint16_t u; memcpy(&u, p, sizeof(u));
+	p += sizeof(u);
+	return (int16_t) be16toh(u);
+}
+
+#define COPY_SIGNATURE "PGCOPY\n\377\r\n\0"
+#define COPY_SIGNATURE_LEN 11
+
+/// Get the next row of a binary COPY. Each call to PQgetCopyData()
+/// hands back exactly one row; the file header arrives glued to the
+/// front of the first row, and the trailer arrives by itself.
+///
+/// Text values are copied into `_rowbuf`, so that they can be
+/// null-terminated; numbers are decoded into `dvalues`.
+bool
+LLPGRecordSet::fetch_copy_row(void)
+{
+	LLPGConnection* pgc = static_cast<LLPGConnection*>(conn);
+
+	while (_copy_active)
+	{
+		if (_copybuf) PQfreemem(_copybuf);
+		_copybuf = nullptr;
+
+		int len = PQgetCopyData(pgc->_pgconn, &_copybuf, 0);
+		if (len < 0)
+		{
+			// Done, or broken. Either way, collect the final status.
+			_copy_active = false;
+			PGresult* res = PQgetResult(pgc->_pgconn);
+			try
+			{
+				pgc->check_result(res, "COPY TO STDOUT", false);
+			}
+			catch (...)
+			{
+				PQclear(res);
+				while ((res = PQgetResult(pgc->_pgconn))) PQclear(res);
+				throw;
+			}
+			PQclear(res);
+			while ((res = PQgetResult(pgc->_pgconn))) PQclear(res);
+			return false;
+		}
+
+		const char* p = _copybuf;
+		const char* end = _copybuf + len;
+		if (not _copy_header)
+		{
+			if (len < COPY_SIGNATURE_LEN + 8 or
+			    memcmp(p, COPY_SIGNATURE, COPY_SIGNATURE_LEN))
+				throw opencog::RuntimeException(TRACE_INFO,
+					"Bad COPY header");
+			p += COPY_SIGNATURE_LEN;
+			copy_int32(p);                    // Flags; unused.
+			int32_t extlen = copy_int32(p);   // Header extension.
+			p += extlen;
+			_copy_header = true;
+		}
+		if (end <= p) continue;
+
+		int16_t nfields = copy_int16(p);
+		if (nfields < 0) continue;  // Trailer; the next call ends it.
+
+		if (ncols < 0) get_column_labels();
+		if (nfields != ncols)
+			throw opencog::RuntimeException(TRACE_INFO,
+				"COPY row has %d fields, expecting %d", nfields, ncols);
+
+		// Room for all of the data, plus a null per field. Reserving
+		// up front keeps the value pointers stable.
+		_rowbuf.clear();
+		_rowbuf.reserve(len + ncols);
+		for (int i=0; i<ncols; i++)
+		{
+			int32_t flen = copy_int32(p);
+			if (end < p + flen)
+				throw opencog::RuntimeException(TRACE_INFO,
+					"Truncated COPY row");
+			vsizes[i] = flen;
+			if (flen < 0)
+			{
+				values[i] = (char*) "";
+				continue;
+			}
+			if (LL_NUMERIC_COLUMN == column_datatype[i])
+				dvalues[i] = decode_number(PQftype(_result, i), p);
+
+			size_t off = _rowbuf.size();
+			_rowbuf.insert(_rowbuf.end(), p, p + flen);
+			_rowbuf.push_back(0);
+			values[i] = _rowbuf.data() + off;
+			p += flen;
+		}
+		return true;
+	}
+	return false;
+}
+
+/* =========================================================== */
+
+/// Get the next batch of rows from the cursor. Returns false if
+/// the cursor is exhausted.
+bool
+LLPGRecordSet::fetch_batch(void)
+{
+	LLPGConnection* pgc = static_cast<LLPGConnection*>(conn);
+
+	PQclear(_result);
+	_result = PQexecParams(pgc->_pgconn, _fetch.c_str(),
+		0, nullptr, nullptr, nullptr, nullptr, _binary ? 1 : 0);
+	pgc->check_result(_result, _fetch.c_str(), false);
+
+	// The column labels point into the old result; refresh them.
+	ncols = -1;
+	_curr_row = 0;
+	_nrows = PQntuples(_result);
+	return 0 < _nrows;
 }
 
 /* =========================================================== */
@@ -214,18 +889,31 @@ LLPGRecordSet::get_column_labels(void)
 bool
 LLPGRecordSet::fetch_row(void)
 {
+	if (_copy) return fetch_copy_row();
+
 	if (_nrows < 0)
 	{
 		_curr_row = 0;
 		_nrows = PQntuples(_result);
 	}
+
+	// A short batch means that the cursor has run dry.
+	if (_nrows <= _curr_row and _batch <= _nrows and 0 < _batch)
+		fetch_batch();
+
 	if (_nrows <= _curr_row or _curr_row < 0) return false;
 
 	if (ncols < 0) get_column_labels();
 
-	for (int i=0; i< ncols; i++)
+	if (_binary)
+	{
+		for (int i=0; i< ncols; i++)
+			decode_value(i);
+	}
+	else
 	{
-		values[i] = PQgetvalue(_result, _curr_row, i);
+		for (int i=0; i< ncols; i++)
+			values[i] = PQgetvalue(_result, _curr_row, i);
 	}
 	_curr_row++;
 	return true;
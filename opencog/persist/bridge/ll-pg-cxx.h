@@ -25,6 +25,9 @@
 #ifndef _OPENCOG_PERSISTENT_POSTGRES_DRIVER_H
 #define _OPENCOG_PERSISTENT_POSTGRES_DRIVER_H
 
+#include <map>
+#include <string>
+#include <vector>
 #include <postgresql/libpq-fe.h>
 
 #include "llapi.h"
@@ -42,11 +45,30 @@ class LLPGConnection : public LLConnection
 		PGconn* _pgconn;
 		LLPGRecordSet* get_record_set(void);
 
+		// Statements prepared on this connection, by query text. If
+		// the tables are reloaded, the text of a lookup may change; the
+		// new text is then a new statement. Postgres truncates statement
+		// names to 63 bytes, so short names are generated.
+		std::map<std::string, std::string> _prepared;
+		unsigned long _stmt_seq;
+		void check_result(PGresult*, const char *, bool);
+
 	public:
 		LLPGConnection(const char * uri);
 		~LLPGConnection();
 
+		bool check(void);
+
 		LLRecordSet *exec(const char *, bool);
+		LLRecordSet *stream(const char *, size_t, bool);
+		LLRecordSet *copy_out(const char *);
+		void copy_in(const char *, const std::string&);
+		LLRecordSet *exec_params(const char *, int,
+		                         const char * const *, bool);
+		LLRecordSet *exec_prepared(const char *, int,
+		                           const char * const *, bool);
+		std::vector<LLRecordSet*>
+			exec_pipeline(const std::vector<LLQuery>&, bool);
 };
 
 class LLPGRecordSet : public LLRecordSet
@@ -57,6 +79,25 @@ class LLPGRecordSet : public LLRecordSet
 		int _nrows;
 		int _curr_row;
 
+		// Non-empty if rows are being pulled from a server-side cursor.
+		// `_close` is run when done with it.
+		std::string _fetch;
+		std::string _close;
+		int _batch;
+		bool fetch_batch(void);
+
+		// True if the results are in binary format.
+		bool _binary;
+		void decode_value(int);
+
+		// For COPY TO STDOUT. The described SELECT is held in _result.
+		bool _copy;
+		bool _copy_active;
+		bool _copy_header;
+		char* _copybuf;
+		std::vector<char> _rowbuf;
+		bool fetch_copy_row(void);
+
 		void setup_cols(int ncols);
 		LLPGRecordSet(LLPGConnection *);
 		~LLPGRecordSet();
@@ -70,6 +111,9 @@ class LLPGRecordSet : public LLRecordSet
 		// call this, instead of the destructor,
 		// when done with this instance.
 		void release(void);
+
+		// Decode one binary-format number, of the given type OID.
+		static double decode_number(Oid, const char*);
 };
 
 /** @}*/
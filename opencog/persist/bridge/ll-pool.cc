@@ -0,0 +1,244 @@
+/*
+ * FUNCTION:
+ * Pool of low-level database connections.
+ *
+ * HISTORY:
+ * Copyright (c) 2022 Linas Vepstas
+ *
+ * LICENSE:
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <string>
+
+#include <opencog/util/exceptions.h>
+#include <opencog/util/Logger.h>
+
+#include "ll-pool.h"
+
+/* =========================================================== */
+
+LLConnPool::LLConnPool(void) :
+	_min(1), _max(1), _idle_timeout(60), _total(0), _closed(true),
+	_num_opened(0), _num_trimmed(0), _num_broken(0)
+{
+}
+
+LLConnPool::~LLConnPool()
+{
+	close();
+}
+
+void LLConnPool::configure(const Factory& factory, size_t min, size_t max,
+                           unsigned int idle_secs)
+{
+	_factory = factory;
+	_min = (0 < min) ? min : 1;
+	_max = (_min < max) ? max : _min;
+	_idle_timeout = std::chrono::seconds(idle_secs);
+}
+
+/// Open the minimum number of connections. If one of them can't be
+/// opened, the ones that were are put back into the pool, and the
+/// error is passed on.
+void LLConnPool::open(void)
+{
+	{
+		std::unique_lock<std::mutex> lck(_mtx);
+		_closed = false;
+	}
+
+	std::vector<LLConnection*> conns;
+	try
+	{
+		while (size() < _min)
+			conns.push_back(value_pop());
+	}
+	catch (...)
+	{
+		for (LLConnection* conn : conns)
+			push(conn);
+		throw;
+	}
+	for (LLConnection* conn : conns)
+		push(conn);
+}
+
+/// Close all idle connections. Connections still in use are closed
+/// when they are returned. Threads waiting for a connection get an
+/// exception.
+void LLConnPool::close(void)
+{
+	std::unique_lock<std::mutex> lck(_mtx);
+	_closed = true;
+	for (auto& pr : _idle)
+		delete pr.first;
+	_total -= _idle.size();
+	_idle.clear();
+	_cv.notify_all();
+}
+
+/* =========================================================== */
+
+LLConnection* LLConnPool::value_pop(void)
+{
+	std::unique_lock<std::mutex> lck(_mtx);
+	while (true)
+	{
+		if (_closed)
+			throw opencog::RuntimeException(TRACE_INFO,
+				"The connection pool is closed");
+
+		if (0 < _idle.size())
+		{
+			LLConnection* conn = _idle.back().first;
+			_idle.pop_back();
+
+			// Check the health outside of the lock; a reset
+			// might take a while.
+			lck.unlock();
+			if (conn->check()) return conn;
+
+			opencog::logger().warn("Replacing broken database connection");
+			delete conn;
+			lck.lock();
+			_total--;
+			_num_broken++;
+			continue;
+		}
+
+		// Grow the pool, if allowed.
+		if (_total < _max)
+		{
+			_total++;
+			lck.unlock();
+			try
+			{
+				LLConnection* conn = _factory();
+				lck.lock();
+				_num_opened++;
+				return conn;
+			}
+			catch (...)
+			{
+				lck.lock();
+				_total--;
+				_cv.notify_one();
+				throw;
+			}
+		}
+
+		_cv.wait(lck);
+	}
+}
+
+void LLConnPool::push(LLConnection* conn)
+{
+	if (not conn->connected())
+	{
+		discard(conn);
+		return;
+	}
+
+	std::unique_lock<std::mutex> lck(_mtx);
+	if (_closed)
+	{
+		_total--;
+		lck.unlock();
+		delete conn;
+		return;
+	}
+	_idle.push_back({conn, Clock::now()});
+	trim(lck);
+	_cv.notify_one();
+}
+
+void LLConnPool::discard(LLConnection* conn)
+{
+	delete conn;
+
+	std::unique_lock<std::mutex> lck(_mtx);
+	_total--;
+	_num_broken++;
+	_cv.notify_one();
+}
+
+/// Close connections that have been idle for too long, as long as
+/// there are more than the minimum number open. The oldest idle
+/// connections are at the front.
+void LLConnPool::trim(std::unique_lock<std::mutex>& lck)
+{
+	Clock::time_point cutoff = Clock::now() - _idle_timeout;
+	size_t ntrim = 0;
+	while (ntrim + 1 < _idle.size() and _min < _total - ntrim and
+	       _idle[ntrim].second < cutoff)
+		ntrim++;
+	if (0 == ntrim) return;
+
+	std::vector<LLConnection*> stale;
+	for (size_t i=0; i<ntrim; i++)
+		stale.push_back(_idle[i].first);
+	_idle.erase(_idle.begin(), _idle.begin() + ntrim);
+	_total -= ntrim;
+	_num_trimmed += ntrim;
+
+	lck.unlock();
+	for (LLConnection* conn : stale)
+		delete conn;
+	lck.lock();
+}
+
+/* =========================================================== */
+
+bool LLConnPool::is_closed(void)
+{
+	std::unique_lock<std::mutex> lck(_mtx);
+	return _closed;
+}
+
+bool LLConnPool::is_empty(void)
+{
+	std::unique_lock<std::mutex> lck(_mtx);
+	return 0 == _total;
+}
+
+size_t LLConnPool::size(void)
+{
+	std::unique_lock<std::mutex> lck(_mtx);
+	return _total;
+}
+
+size_t LLConnPool::idle_size(void)
+{
+	std::unique_lock<std::mutex> lck(_mtx);
+	return _idle.size();
+}
+
+std::string LLConnPool::stats(void)
+{
+	std::unique_lock<std::mutex> lck(_mtx);
+	std::string rs;
+	rs += "Connections open: " + std::to_string(_total);
+	rs += " (" + std::to_string(_idle.size()) + " idle)";
+	rs += "; min " + std::to_string(_min);
+	rs += ", max " + std::to_string(_max) + "\n";
+	rs += "Connections opened: " + std::to_string(_num_opened);
+	rs += "; trimmed: " + std::to_string(_num_trimmed);
+	rs += "; broken: " + std::to_string(_num_broken) + "\n";
+	return rs;
+}
+
+/* ============================= END OF FILE ================= */
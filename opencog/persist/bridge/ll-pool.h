@@ -0,0 +1,115 @@
+/*
+ * FUNCTION:
+ * Pool of low-level database connections.
+ *
+ * HISTORY:
+ * Copyright (c) 2022 Linas Vepstas
+ *
+ * LICENSE:
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _OPENCOG_PERSISTENT_LL_POOL_H
+#define _OPENCOG_PERSISTENT_LL_POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "llapi.h"
+
+/** \addtogroup grp_persist
+ *  @{
+ */
+
+/**
+ * Elastic pool of connections. The pool keeps at least `min`
+ * connections open, and opens more on demand, up to `max`, when
+ * all of the open ones are busy. Connections that sit idle for
+ * longer than the idle timeout are closed again, down to `min`.
+ *
+ * Connections are health-checked when they are handed out; broken
+ * ones are reset, or, failing that, replaced by new ones.
+ *
+ * Once closed, the pool hands out no more connections, until it is
+ * opened again; connections returned to it are closed.
+ *
+ * This class is thread-safe.
+ */
+class LLConnPool
+{
+	public:
+		typedef std::function<LLConnection*(void)> Factory;
+		typedef std::chrono::steady_clock Clock;
+
+	private:
+		Factory _factory;
+		size_t _min;
+		size_t _max;
+		std::chrono::seconds _idle_timeout;
+
+		std::mutex _mtx;
+		std::condition_variable _cv;
+
+		// Idle connections, with the time they were returned.
+		// Most recently used are at the back.
+		std::vector<std::pair<LLConnection*, Clock::time_point>> _idle;
+
+		// Number of connections, idle or in use.
+		size_t _total;
+
+		// Set by close(), cleared by open().
+		bool _closed;
+
+		// Stats
+		size_t _num_opened;
+		size_t _num_trimmed;
+		size_t _num_broken;
+
+		void trim(std::unique_lock<std::mutex>&);
+
+	public:
+		LLConnPool(void);
+		~LLConnPool();
+
+		void configure(const Factory&, size_t min, size_t max,
+		               unsigned int idle_secs);
+		void open(void);
+		void close(void);
+
+		// Get a connection. Blocks, if `max` connections are in use.
+		LLConnection* value_pop(void);
+
+		// Return a connection to the pool.
+		void push(LLConnection*);
+
+		// Close a connection that is known to be broken.
+		void discard(LLConnection*);
+
+		bool is_closed(void);
+		bool is_empty(void);
+		size_t size(void);
+		size_t idle_size(void);
+		size_t max_size(void) const { return _max; }
+		std::string stats(void);
+};
+
+/** @}*/
+
+#endif // _OPENCOG_PERSISTENT_LL_POOL_H
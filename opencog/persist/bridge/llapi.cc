@@ -74,6 +74,7 @@ LLRecordSet::LLRecordSet(LLConnection *_conn)
     column_labels = nullptr;
     column_datatype = nullptr;
     values = nullptr;
+    dvalues = nullptr;
     vsizes = nullptr;
 }
 
@@ -100,6 +101,9 @@ LLRecordSet::~LLRecordSet()
     if (values) delete[] values;
     values = nullptr;
 
+    if (dvalues) delete[] dvalues;
+    dvalues = nullptr;
+
     if (vsizes) delete[] vsizes;
     vsizes = nullptr;
 }
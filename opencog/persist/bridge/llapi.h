@@ -30,6 +30,7 @@
 
 #include <stack>
 #include <string>
+#include <vector>
 
 /** \addtogroup grp_persist
  *  @{
@@ -37,6 +38,21 @@
 
 class LLRecordSet;
 
+// A single prepared-statement query, as one entry in a batch of
+// queries sent with LLConnection::exec_pipeline().
+struct LLQuery
+{
+    std::string query;               // Query text, to prepare it from.
+    std::vector<std::string> params; // Parameter values.
+};
+
+// Column types, for drivers that decode values themselves.
+enum LLColumnType
+{
+    LL_TEXT_COLUMN = 0,      // Value is a C string.
+    LL_NUMERIC_COLUMN = 1,   // Value is a double.
+};
+
 class LLConnection
 {
     friend class LLRecordSet;
@@ -51,7 +67,46 @@ class LLConnection
         // No future version of this must ever throw!
         bool connected(void) const { return is_connected; }
 
+        // Check the health of the connection, and try to re-establish
+        // it, if it is broken. Returns false if it cannot be fixed.
+        // This is cheap, if the connection is healthy.
+        virtual bool check(void) = 0;
+
         virtual LLRecordSet *exec(const char *, bool=false) = 0;
+
+        // Like exec(), but the rows are delivered in batches of the
+        // given size, instead of all at once. Use this for queries
+        // that might return more rows than fit comfortably in RAM.
+        virtual LLRecordSet *stream(const char *, size_t, bool=false) = 0;
+
+        // Like stream(), but using the database's bulk-export
+        // mechanism, if it has one. Values are in binary format.
+        virtual LLRecordSet *copy_out(const char *) = 0;
+
+        // Bulk-load rows into a table, using the database's bulk-import
+        // mechanism. The statement is a `COPY ... FROM STDIN`; the rows
+        // are in the text format, one per line. Throws on failure.
+        virtual void copy_in(const char *, const std::string&) = 0;
+
+        // Run a query with parameters. If `binary` is set, then
+        // numeric columns are transferred in the binary format, and
+        // are available via LLRecordSet::get_column_double().
+        virtual LLRecordSet *exec_params(const char *, int,
+                                         const char * const *, bool) = 0;
+
+        // Run a prepared statement. The statement is identified by
+        // its query text; it is prepared the first time that the text
+        // is seen on this connection.
+        virtual LLRecordSet *exec_prepared(const char *, int,
+                                           const char * const *,
+                                           bool) = 0;
+
+        // Run a batch of prepared statements, sending all of them
+        // before waiting for any results, if the driver can do that.
+        // One record set is returned per query, in the same order.
+        // The caller must release each of them.
+        virtual std::vector<LLRecordSet*>
+            exec_pipeline(const std::vector<LLQuery>&, bool) = 0;
 };
 
 class LLRecordSet
@@ -65,6 +120,7 @@ class LLRecordSet
         char **column_labels;
         int  *column_datatype;
         char **values;
+        double *dvalues;
         int  *vsizes;
 
         LLRecordSet(LLConnection *);
@@ -81,6 +137,15 @@ class LLRecordSet
         int get_column_count();
         const char * get_column_value(int column);
 
+        // Numeric columns in binary-format results are decoded
+        // directly to doubles, skipping the string conversion.
+        // SQL NULL values are never numeric; they are empty strings.
+        bool is_numeric_value(int column) const
+            { return LL_NUMERIC_COLUMN == column_datatype[column]
+                     and 0 <= vsizes[column]; }
+        double get_column_double(int column) const
+            { return dvalues[column]; }
+
         // call this, instead of the destructor,
         // when done with this instance.
         virtual void release(void);
@@ -18,7 +18,8 @@
 
 (load-extension (string-append opencog-ext-path-persist-bridge "libpersist-bridge") "opencog_persist_bridge_init")
 
-(export cog-bridge-load-tables cog-bridge-load-rows)
+(export cog-bridge-load-tables cog-bridge-load-rows cog-bridge-load-query
+	cog-bridge-project cog-bridge-forget)
 
 (set-procedure-property! cog-bridge-load-tables 'documentation
 "
@@ -26,6 +27,13 @@
 
   Optionally specify the SQL schema name from which to load the tables.
   (not implemeneted)
+
+  The estimated size of each table is attached to its Predicate, as a
+  FloatValue holding the number of rows, the number of disk pages, and
+  the total number of bytes, including indexes. For example:
+    (cog-value (Predicate \"feature\") (Predicate \"*-bridge-table-size-*\"))
+  These are the estimates kept by Postgres; the number of rows is -1
+  if the table was never analyzed.
 ")
 
 (set-procedure-property! cog-bridge-load-rows 'documentation
@@ -44,6 +52,67 @@
         (Number 362100))
 ")
 
+(set-procedure-property! cog-bridge-load-query 'documentation
+"
+  cog-bridge-load-query STORAGE QUERY - Load the rows needed by QUERY
+
+  QUERY must be a QueryLink or a MeetLink. Each clause of the form
+  (Edge (Predicate TABLE) (List ...)) is turned into an SQL SELECT on
+  that table. Constants in the List, as well as Equal, GreaterThan and
+  LessThan comparisons between variables and constants, become the
+  WHERE clause, so that only the matching rows are loaded. Comparisons
+  under Or, Not and such are not used. Once the rows are loaded, run
+  the query as usual.
+
+  Example:
+    (define qry
+       (Meet
+          (VariableList (Variable \"$id\") (Variable \"$name\"))
+          (And
+             (Present
+                (Edge (Predicate \"genotype\")
+                   (List (Variable \"$id\") (Variable \"$name\")
+                      (Concept \"foo\"))))
+             (GreaterThan (Variable \"$id\") (Number 362100)))))
+    (cog-bridge-load-query (BridgeStorage \"postgres:///flybase\") qry)
+    (cog-execute! qry)
+")
+
+(set-procedure-property! cog-bridge-project 'documentation
+"
+  cog-bridge-project STORAGE TABLE COLUMNS - Use only some columns of TABLE
+
+  COLUMNS is a VariableList of the column Variables to keep, or just
+  one Variable. This returns a new Predicate, standing for a table that
+  has only those columns. It has its own Signature, and its rows are
+  Edges on the new Predicate, so they cannot be confused with full rows.
+  Loading it fetches only the given columns from the database. Use it
+  in place of TABLE, with fetch-incoming-set or cog-bridge-load-rows.
+
+  Example:
+    (define sto (BridgeStorage \"postgres:///flybase\"))
+    (define feat (cog-bridge-project sto (Predicate \"feature\")
+        (VariableList (Variable \"feature_id\") (Variable \"name\"))))
+    ; feat is (Predicate \"feature(feature_id, name)\")
+    (cog-bridge-load-rows sto feat (Variable \"name\") (Concept \"Adh\"))
+")
+
+(set-procedure-property! cog-bridge-forget 'documentation
+"
+  cog-bridge-forget STORAGE ITEM - Forget that ITEM was loaded
+
+  Tables and rows that were loaded are not fetched again for a while
+  (see the `memo_ttl` URI option). This forgets them, so that the next
+  fetch goes to the database again. ITEM may be a table Predicate, a
+  column Variable, or an entry in some row. If ITEM is STORAGE itself,
+  then everything is forgotten.
+
+  Example:
+    (define sto (BridgeStorage \"postgres:///flybase\"))
+    (cog-bridge-forget sto (Predicate \"genotype\"))
+    (fetch-incoming-set (Predicate \"genotype\"))
+")
+
 ;;;(set-procedure-property! sql-open 'documentation
 ;;;"
 ;;; sql-open URL - Open a connection to a database.